@@ -0,0 +1,250 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * microbenchmarks of the network core, written as JSON so runs can be compared across commits. every benchmark is run for
+ * every input size the data ships with and, where the operation has a batched form, for batch sizes 1 to 256.
+ *
+ * FLOP counts are nominal, one multiply-add is two FLOPs:
+ *  layer_t::call           2 * in * out per sample
+ *  layer_t::back_prop      2 * in * out for dw plus 2 * out * next_out to pull the error back from the next layer, per sample
+ *  layer_t::update         4 * in * out + 2 * out per update, batch size doesn't apply
+ *  network_t::execute      the sum of call over every layer
+ *  network_t::train        three times execute per sample, plus one update per batch spread over the batch
+ */
+
+#include <assign2/common.h>
+#include <assign2/functions.h>
+#include <assign2/initializers.h>
+#include <assign2/kernels.h>
+#include <assign2/layer.h>
+#include <assign2/network.h>
+#include <blt/parse/argparse.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace assign2;
+
+namespace
+{
+    const std::vector<blt::i32> input_sizes = {16, 25, 32, 64, 150, 1000};
+    const std::vector<blt::size_t> batch_sizes = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    // points in the synthetic dataset, enough that the largest batch divides it a few times over
+    constexpr blt::size_t point_count = 1024;
+
+    struct result_t
+    {
+        std::string benchmark;
+        blt::i32 input_size;
+        blt::size_t batch_size;
+        double ns_per_sample;
+        double flops_per_sample;
+    };
+
+    /**
+     * calls func, which processes samples_per_call samples, until min_time has passed after a warm up call
+     * @return nanoseconds per sample
+     */
+    template<typename Func>
+    double measure(Func&& func, blt::size_t samples_per_call, std::chrono::milliseconds min_time)
+    {
+        func();
+        blt::size_t samples = 0;
+        const auto start = std::chrono::steady_clock::now();
+        auto now = start;
+        for (; now - start < min_time; now = std::chrono::steady_clock::now())
+        {
+            func();
+            samples += samples_per_call;
+        }
+        return std::chrono::duration<double, std::nano>(now - start).count() / static_cast<double>(samples);
+    }
+
+    /**
+     * the same shape create_network() in src/main.cpp builds, input -> input / 2 -> input / 4 -> 2
+     */
+    std::vector<blt::i32> network_shape(blt::i32 input)
+    {
+        return {input, static_cast<blt::i32>(input * 0.5), static_cast<blt::i32>(input * 0.25), 2};
+    }
+
+    std::unique_ptr<layer_t> make_layer(blt::i32 in, blt::i32 out, random_init& randomizer)
+    {
+        return std::make_unique<layer_t>(in, out, sigmoid_function{}, randomizer, empty_init{});
+    }
+
+    network_t make_network(blt::i32 input, random_init& randomizer)
+    {
+        const auto shape = network_shape(input);
+        std::vector<std::unique_ptr<layer_t>> layers;
+        for (blt::size_t i = 0; i + 1 < shape.size(); i++)
+            layers.push_back(make_layer(shape[i], shape[i + 1], randomizer));
+        return network_t{std::move(layers)};
+    }
+
+    struct dataset_t
+    {
+        std::vector<Scalar> bins;
+        data_file_t file;
+        // every point as a column
+        matrix_t matrix;
+    };
+
+    dataset_t make_dataset(blt::i32 input, std::mt19937& random)
+    {
+        std::uniform_real_distribution<Scalar> values(0, 1);
+        dataset_t data;
+        data.bins.resize(point_count * static_cast<blt::size_t>(input));
+        for (auto& v : data.bins)
+            v = values(random);
+        data.matrix = Eigen::Map<matrix_t>(data.bins.data(), input, static_cast<Eigen::Index>(point_count));
+        for (blt::size_t i = 0; i < point_count; i++)
+            data.file.data_points.push_back({i % 2 == 0, span<const Scalar>{data.bins.data() + i * static_cast<blt::size_t>(input),
+                                                                             static_cast<blt::size_t>(input)}});
+        return data;
+    }
+
+    void bench_size(blt::i32 input, std::chrono::milliseconds min_time, std::vector<result_t>& results)
+    {
+        random_init randomizer{static_cast<blt::size_t>(input)};
+        std::mt19937 random{static_cast<std::mt19937::result_type>(input)};
+        const auto data = make_dataset(input, random);
+        const auto shape = network_shape(input);
+        const auto in = static_cast<double>(shape[0]);
+        const auto out = static_cast<double>(shape[1]);
+        const auto next_out = static_cast<double>(shape[2]);
+        double network_macs = 0;
+        for (blt::size_t i = 0; i + 1 < shape.size(); i++)
+            network_macs += static_cast<double>(shape[i]) * static_cast<double>(shape[i + 1]);
+        Scalar omega = 0.001;
+
+        // the layer benchmarks use the first layer, the largest in every network, with the second behind it for back prop
+        auto layer = make_layer(shape[0], shape[1], randomizer);
+        auto next = make_layer(shape[1], shape[2], randomizer);
+        const std::vector<Scalar> next_expected(static_cast<blt::size_t>(shape[2]), 0.5f);
+
+        for (auto batch : batch_sizes)
+        {
+            if (batch == 1)
+            {
+                blt::size_t i = 0;
+                results.push_back({"layer_t::call", input, batch, measure([&]() {
+                    layer->call(data.file.data_points[i++ % point_count].bins);
+                }, 1, min_time), 2 * in * out});
+
+                next->call(layer->call(data.file.data_points[0].bins));
+                next->back_prop(layer->call(data.file.data_points[0].bins), next_expected);
+                results.push_back({"layer_t::back_prop", input, batch, measure([&]() {
+                    layer->back_prop(data.file.data_points[i++ % point_count].bins, *next);
+                }, 1, min_time), 2 * in * out + 2 * out * next_out});
+
+                results.push_back({"layer_t::update", input, batch, measure([&]() {
+                    layer->update(&omega, false);
+                }, 1, min_time), 4 * in * out + 2 * out});
+            } else
+            {
+                const matrix_t batch_input = data.matrix.leftCols(static_cast<Eigen::Index>(batch));
+                results.push_back({"layer_t::call", input, batch, measure([&]() {
+                    layer->call_batch(batch_input);
+                }, batch, min_time), 2 * in * out});
+
+                const matrix_t next_expected_batch = matrix_t::Constant(shape[2], static_cast<Eigen::Index>(batch), 0.5f);
+                const auto& hidden = layer->call_batch(batch_input);
+                next->call_batch(hidden);
+                next->back_prop_batch(hidden, next_expected_batch, 1);
+                results.push_back({"layer_t::back_prop", input, batch, measure([&]() {
+                    layer->back_prop_batch(batch_input, *next, 1.0f / static_cast<Scalar>(batch));
+                }, batch, min_time), 2 * in * out + 2 * out * next_out});
+            }
+        }
+
+        auto network = make_network(input, randomizer);
+        network.with_momentum(&omega);
+        for (auto batch : batch_sizes)
+        {
+            if (batch == 1)
+            {
+                results.push_back({"network_t::train", input, batch, measure([&]() {
+                    network.train_epoch(data.file);
+                }, point_count, min_time), 6 * network_macs + 4 * network_macs});
+
+                blt::size_t i = 0;
+                results.push_back({"network_t::execute", input, batch, measure([&]() {
+                    network.execute(data.file.data_points[i++ % point_count].bins);
+                }, 1, min_time), 2 * network_macs});
+            } else
+            {
+                results.push_back({"network_t::train", input, batch, measure([&]() {
+                    network.train_batch(data.file.data_points, batch);
+                }, point_count, min_time), 6 * network_macs + 4 * network_macs / static_cast<double>(batch)});
+
+                const matrix_t batch_input = data.matrix.leftCols(static_cast<Eigen::Index>(batch));
+                results.push_back({"network_t::execute", input, batch, measure([&]() {
+                    network.execute_batch(batch_input);
+                }, batch, min_time), 2 * network_macs});
+            }
+        }
+    }
+
+    std::string to_json(const std::vector<result_t>& results)
+    {
+        std::stringstream json;
+        json << "{\n  \"kernels\": \"" << kernels().name << "\",\n  \"results\": [\n";
+        for (auto [i, r] : blt::enumerate(results))
+        {
+            const auto samples_per_sec = 1e9 / r.ns_per_sample;
+            json << "    {\"benchmark\": \"" << r.benchmark << "\", \"input_size\": " << r.input_size << ", \"batch_size\": " << r.batch_size
+                 << ", \"samples_per_sec\": " << samples_per_sec << ", \"ns_per_sample\": " << r.ns_per_sample
+                 << ", \"gflops\": " << r.flops_per_sample * samples_per_sec / 1e9 << "}" << (i + 1 == results.size() ? "\n" : ",\n");
+        }
+        json << "  ]\n}\n";
+        return json.str();
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    blt::arg_parse parser;
+    parser.addArgument(blt::arg_builder("-o", "--output").setHelp("Write the JSON results to FILE instead of stdout").setMetavar("FILE").build());
+    parser.addArgument(blt::arg_builder("--min-time").setHelp("Milliseconds each benchmark runs for").setDefault("100").setMetavar("MS").build());
+    parser.addArgument(blt::arg_builder("--size").setHelp("Only benchmark networks with this many inputs").setMetavar("BINS").build());
+    auto args = parser.parse_args(argc, argv);
+
+    const std::chrono::milliseconds min_time{std::stoul(args.get<std::string>("min-time"))};
+    std::vector<result_t> results;
+    for (auto input : input_sizes)
+    {
+        if (args.contains("size") && std::stoi(args.get<std::string>("size")) != input)
+            continue;
+        std::cerr << "Benchmarking size " << input << std::endl;
+        bench_size(input, min_time, results);
+    }
+
+    const auto json = to_json(results);
+    if (args.contains("output"))
+        std::ofstream{args.get<std::string>("output")} << json;
+    else
+        std::cout << json;
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_ALLOC_TRACKER_H
+#define COSC_4P80_ASSIGNMENT_2_ALLOC_TRACKER_H
+
+#include <blt/std/types.h>
+#include "blt/std/assert.h"
+
+/**
+ * when ASSIGN2_TRACK_ALLOCATIONS is defined src/alloc_tracker.cpp replaces the global operator new, and on glibc malloc as well so
+ * Eigen's allocations are seen, with ones that count allocations per thread. ASSIGN2_ASSERT_NO_ALLOCATIONS then asserts that
+ * nothing inside the enclosing scope touched the heap. without the define the macro compiles to nothing.
+ */
+#define ASSIGN2_CONCAT_IMPL(a, b) a##b
+#define ASSIGN2_CONCAT(a, b) ASSIGN2_CONCAT_IMPL(a, b)
+
+#ifdef ASSIGN2_TRACK_ALLOCATIONS
+
+namespace assign2
+{
+    inline thread_local blt::size_t allocation_count = 0;
+    
+    class no_allocation_scope_t
+    {
+        public:
+            explicit no_allocation_scope_t(const char* name): name(name), start(allocation_count)
+            {}
+            
+            no_allocation_scope_t(const no_allocation_scope_t&) = delete;
+            
+            no_allocation_scope_t& operator=(const no_allocation_scope_t&) = delete;
+            
+            ~no_allocation_scope_t()
+            {
+                BLT_ASSERT_MSG(allocation_count == start, name);
+            }
+        
+        private:
+            const char* name;
+            blt::size_t start;
+    };
+}
+
+    #define ASSIGN2_ASSERT_NO_ALLOCATIONS(name) const assign2::no_allocation_scope_t ASSIGN2_CONCAT(no_alloc_scope_, __LINE__){name}
+#else
+    #define ASSIGN2_ASSERT_NO_ALLOCATIONS(name)
+#endif
+
+#endif //COSC_4P80_ASSIGNMENT_2_ALLOC_TRACKER_H
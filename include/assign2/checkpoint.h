@@ -0,0 +1,308 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_CHECKPOINT_H
+#define COSC_4P80_ASSIGNMENT_2_CHECKPOINT_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/metrics.h>
+#include <assign2/dataset.h>
+#include <blt/std/logging.h>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace assign2
+{
+    /*
+     * checkpoints are written as <directory>/network<id>.ckpt, in native byte order:
+     *  header          checkpoint_header_t
+     *  parameters      parameter_count values, see network_t::save_parameters
+     *  momentum        momentum_count values, see network_t::save_momentum
+     *  metrics         each of the six training_metrics_t series, metric_epochs values each, in the order save() writes them
+     */
+    
+    struct checkpoint_header_t
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t scalar_size;
+        std::uint64_t epoch;
+        std::uint64_t parameter_count;
+        std::uint64_t momentum_count;
+        std::uint64_t metric_epochs;
+        Scalar last_d_error;
+        std::uint32_t reset_next;
+    };
+    
+    inline constexpr char checkpoint_magic[8] = {'A', '2', 'C', 'H', 'K', 'P', 'N', 'T'};
+    inline constexpr std::uint32_t checkpoint_version = 1;
+    
+    /**
+     * everything needed to carry on training a network from the end of an epoch
+     */
+    struct checkpoint_t
+    {
+        blt::size_t epoch = 0;
+        std::vector<Scalar> parameters;
+        std::vector<Scalar> momentum;
+        network_t::epoch_state_t state{0, false};
+        training_metrics_t metrics;
+        
+        /**
+         * copies the state of network, reusing our buffers so this only allocates while they grow
+         */
+        void capture(const network_t& network, const training_metrics_t& network_metrics, blt::size_t epochs_done)
+        {
+            epoch = epochs_done;
+            parameters.resize(network.parameter_count());
+            network.save_parameters(parameters.data());
+            momentum.resize(network.momentum_count());
+            network.save_momentum(momentum.data());
+            state = network.epoch_state();
+            for (auto series : metric_series())
+                (metrics.*series).assign((network_metrics.*series).begin(), (network_metrics.*series).end());
+        }
+        
+        /**
+         * @return false, leaving network untouched, if the checkpoint is for a network of a different shape
+         */
+        bool restore(network_t& network, training_metrics_t& network_metrics) const
+        {
+            if (parameters.size() != network.parameter_count() || momentum.size() != network.momentum_count())
+                return false;
+            network.load_parameters(parameters.data());
+            network.load_momentum(momentum.data());
+            network.restore_epoch_state(state);
+            for (auto series : metric_series())
+                (network_metrics.*series).assign((metrics.*series).begin(), (metrics.*series).end());
+            return true;
+        }
+        
+        static std::array<std::vector<Scalar> training_metrics_t::*, 6> metric_series()
+        {
+            return {&training_metrics_t::train_error, &training_metrics_t::train_d_error, &training_metrics_t::test_error,
+                    &training_metrics_t::test_d_error, &training_metrics_t::correct_train, &training_metrics_t::correct_test};
+        }
+    };
+    
+    inline std::string checkpoint_path(const std::string& directory, blt::i32 id)
+    {
+        return (std::filesystem::path(directory) / ("network" + std::to_string(id) + ".ckpt")).string();
+    }
+    
+    /**
+     * writes the checkpoint to path durably: the data is synced before a rename puts it in place and the directory is synced after,
+     * so whatever is at path after a crash is always a complete checkpoint
+     * @return false if it couldn't be written
+     */
+    inline bool write_checkpoint(const std::string& path, const checkpoint_t& checkpoint)
+    {
+        checkpoint_header_t header{};
+        std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+        header.version = checkpoint_version;
+        header.scalar_size = sizeof(Scalar);
+        header.epoch = checkpoint.epoch;
+        header.parameter_count = checkpoint.parameters.size();
+        header.momentum_count = checkpoint.momentum.size();
+        header.metric_epochs = checkpoint.metrics.epochs();
+        header.last_d_error = checkpoint.state.last_d_error;
+        header.reset_next = checkpoint.state.reset_next;
+        
+        const auto temp_path = path + ".tmp";
+        auto file = std::fopen(temp_path.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        const auto write_values = [&](const std::vector<Scalar>& values, blt::size_t count) {
+            ok = ok && values.size() >= count && std::fwrite(values.data(), sizeof(Scalar), count, file) == count;
+        };
+        write_values(checkpoint.parameters, checkpoint.parameters.size());
+        write_values(checkpoint.momentum, checkpoint.momentum.size());
+        for (auto series : checkpoint_t::metric_series())
+            write_values(checkpoint.metrics.*series, header.metric_epochs);
+        ok = ok && std::fflush(file) == 0 && ::fsync(::fileno(file)) == 0;
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        
+        // the rename itself is only durable once the directory is
+        auto directory = std::filesystem::path(path).parent_path();
+        if (directory.empty())
+            directory = ".";
+        auto fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+        return true;
+    }
+    
+    /**
+     * @return the checkpoint at path, nothing if there isn't one or it isn't a complete checkpoint
+     */
+    inline std::optional<checkpoint_t> read_checkpoint(const std::string& path)
+    {
+        auto mapping = mapped_file_t::open(path);
+        if (mapping == nullptr || mapping->size() < sizeof(checkpoint_header_t))
+            return {};
+        checkpoint_header_t header{};
+        std::memcpy(&header, mapping->data(), sizeof(header));
+        if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 || header.version != checkpoint_version ||
+            header.scalar_size != sizeof(Scalar))
+            return {};
+        const auto values = header.parameter_count + header.momentum_count + header.metric_epochs * checkpoint_t::metric_series().size();
+        if (sizeof(header) + values * sizeof(Scalar) != mapping->size())
+            return {};
+        
+        checkpoint_t checkpoint;
+        auto ptr = mapping->data() + sizeof(header);
+        const auto read_values = [&ptr](std::vector<Scalar>& out, blt::size_t count) {
+            out.resize(count);
+            std::memcpy(out.data(), ptr, count * sizeof(Scalar));
+            ptr += count * sizeof(Scalar);
+        };
+        checkpoint.epoch = header.epoch;
+        read_values(checkpoint.parameters, header.parameter_count);
+        read_values(checkpoint.momentum, header.momentum_count);
+        for (auto series : checkpoint_t::metric_series())
+            read_values(checkpoint.metrics.*series, header.metric_epochs);
+        checkpoint.state = {header.last_d_error, header.reset_next != 0};
+        return checkpoint;
+    }
+    
+    /**
+     * when and where train_all() checkpoints, a trigger of 0 is disabled
+     */
+    struct checkpoint_options_t
+    {
+        std::string directory;
+        blt::size_t every_epochs = 100;
+        blt::size_t every_seconds = 0;
+        // start each job from its checkpoint if it has one
+        bool resume = false;
+    };
+    
+    /**
+     * checkpoints one network in the background. a snapshot only copies the state into whichever of two buffers the writer thread
+     * isn't using, the writer then puts it on disk, so training never waits on the disk. if training snapshots again before the
+     * writer gets to the last one, the older snapshot is replaced rather than queued.
+     */
+    class checkpointer_t
+    {
+        public:
+            checkpointer_t(std::string path, blt::size_t every_epochs, blt::size_t every_seconds):
+                    path(std::move(path)), every_epochs(every_epochs), every_seconds(every_seconds),
+                    last_snapshot(std::chrono::steady_clock::now())
+            {
+                writer = std::thread([this]() { run(); });
+            }
+            
+            checkpointer_t(const checkpointer_t&) = delete;
+            
+            checkpointer_t& operator=(const checkpointer_t&) = delete;
+            
+            /**
+             * call at the end of every epoch, snapshots if either trigger has been reached
+             */
+            void epoch_finished(const network_t& network, const training_metrics_t& metrics, blt::size_t epochs_done)
+            {
+                const auto now = std::chrono::steady_clock::now();
+                const bool epochs_due = every_epochs > 0 && epochs_done % every_epochs == 0;
+                const bool time_due = every_seconds > 0 && now - last_snapshot >= std::chrono::seconds(every_seconds);
+                if (epochs_due || time_due)
+                    snapshot(network, metrics, epochs_done);
+            }
+            
+            void snapshot(const network_t& network, const training_metrics_t& metrics, blt::size_t epochs_done)
+            {
+                last_snapshot = std::chrono::steady_clock::now();
+                {
+                    std::scoped_lock lock(mutex);
+                    if (!pending)
+                        pending = writing == 0 ? 1 : 0;
+                    buffers[*pending].capture(network, metrics, epochs_done);
+                }
+                condition.notify_one();
+            }
+            
+            /**
+             * writes whatever snapshot is still waiting before returning
+             */
+            ~checkpointer_t()
+            {
+                {
+                    std::scoped_lock lock(mutex);
+                    done = true;
+                }
+                condition.notify_one();
+                writer.join();
+            }
+        
+        private:
+            void run()
+            {
+                std::unique_lock lock(mutex);
+                while (true)
+                {
+                    condition.wait(lock, [this]() { return pending || done; });
+                    if (!pending)
+                        return;
+                    writing = *pending;
+                    pending.reset();
+                    lock.unlock();
+                    if (!write_checkpoint(path, buffers[*writing]))
+                        BLT_WARN("Unable to write checkpoint '%s'", path.c_str());
+                    lock.lock();
+                    writing.reset();
+                }
+            }
+            
+            std::string path;
+            blt::size_t every_epochs;
+            blt::size_t every_seconds;
+            std::chrono::steady_clock::time_point last_snapshot;
+            
+            std::mutex mutex;
+            std::condition_variable condition;
+            checkpoint_t buffers[2];
+            // indices into buffers, the one the writer has and the one waiting for it
+            std::optional<blt::size_t> writing;
+            std::optional<blt::size_t> pending;
+            bool done = false;
+            std::thread writer;
+    };
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_CHECKPOINT_H
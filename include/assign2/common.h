@@ -22,6 +22,13 @@
 #include <iostream>
 #include <blt/iterator/enumerate.h>
 #include <filesystem>
+#include <charconv>
+#include <stdexcept>
+#include <string_view>
+#include <memory>
+#include <type_traits>
+#include <Eigen/Dense>
+#include <assign2/profiler.h>
 
 #ifdef BLT_USE_GRAPHICS
     
@@ -37,6 +44,11 @@ namespace assign2
 //    const inline Scalar learn_rate = 0.001;
     inline Scalar learn_rate = 0.001;
     
+    // used by the batched paths, each column is one sample
+    using matrix_t = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
+    // a matrix_t or the leading columns of one, which is how a short batch is passed in storage sized for a full one
+    using matrix_view_t = Eigen::Ref<const matrix_t>;
+    
     template<typename T>
     decltype(std::cout)& print_vec(const std::vector<T>& vec)
     {
@@ -49,15 +61,81 @@ namespace assign2
         return std::cout;
     }
     
+    /**
+     * non-owning view over contiguous memory. we are stuck on C++17 so this stands in for std::span
+     */
+    template<typename T>
+    class span
+    {
+        public:
+            span() = default;
+            
+            span(T* data, blt::size_t size): m_data(data), m_size(size)
+            {}
+            
+            template<typename U, typename = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+            span(const span<U>& other): m_data(other.data()), m_size(other.size()) // NOLINT
+            {}
+            
+            template<typename Container, typename = decltype(std::declval<Container&>().data())>
+            span(Container& container): m_data(container.data()), m_size(container.size()) // NOLINT
+            {}
+            
+            inline T& operator[](blt::size_t index) const
+            {
+                return m_data[index];
+            }
+            
+            [[nodiscard]] inline blt::size_t size() const
+            {
+                return m_size;
+            }
+            
+            [[nodiscard]] inline bool empty() const
+            {
+                return m_size == 0;
+            }
+            
+            [[nodiscard]] inline T* data() const
+            {
+                return m_data;
+            }
+            
+            [[nodiscard]] inline T* begin() const
+            {
+                return m_data;
+            }
+            
+            [[nodiscard]] inline T* end() const
+            {
+                return m_data + m_size;
+            }
+            
+            /**
+             * @return a view of the elements [offset, offset + count), clamped to the end of this span
+             */
+            [[nodiscard]] inline span subspan(blt::size_t offset, blt::size_t count) const
+            {
+                return {m_data + offset, std::min(count, m_size - offset)};
+            }
+        
+        private:
+            T* m_data = nullptr;
+            blt::size_t m_size = 0;
+    };
+    
     struct data_t
     {
         bool is_bad = false;
-        std::vector<Scalar> bins;
+        // points into the storage of the data_file_t this was loaded into
+        span<const Scalar> bins;
     };
     
     struct data_file_t
     {
         std::vector<data_t> data_points;
+        // keeps the memory the bins point into alive, files built out of another file's points must share its storage
+        std::shared_ptr<const void> storage;
     };
     
     struct error_data_t
@@ -77,16 +155,50 @@ namespace assign2
     
     class network_t;
     
+    using array_map_t = Eigen::Map<Eigen::Array<Scalar, Eigen::Dynamic, 1>>;
+    using const_array_map_t = Eigen::Map<const Eigen::Array<Scalar, Eigen::Dynamic, 1>>;
+    
+    inline array_map_t as_array(span<Scalar> values)
+    {
+        return {values.data(), static_cast<Eigen::Index>(values.size())};
+    }
+    
+    inline const_array_map_t as_array(span<const Scalar> values)
+    {
+        return {values.data(), static_cast<Eigen::Index>(values.size())};
+    }
+    
     struct function_t
     {
         [[nodiscard]] virtual Scalar call(Scalar) const = 0;
         
         [[nodiscard]] virtual Scalar derivative(Scalar) const = 0;
+        
+        /**
+         * out[i] = call(in[i]) for a whole layer at once, so we pay for one virtual call per layer instead of one per neuron.
+         * implementations should override this with something that vectorizes
+         */
+        virtual void apply(span<const Scalar> in, span<Scalar> out) const
+        {
+            for (blt::size_t i = 0; i < in.size(); i++)
+                out[i] = call(in[i]);
+        }
+        
+        /**
+         * out[i] = derivative(in[i]), see apply()
+         */
+        virtual void derivative(span<const Scalar> in, span<Scalar> out) const
+        {
+            for (blt::size_t i = 0; i < in.size(); i++)
+                out[i] = derivative(in[i]);
+        }
     };
     
     struct weight_view
     {
         public:
+            weight_view() = default;
+            
             weight_view(Scalar* data, blt::size_t size): m_data(data), m_size(size)
             {}
             
@@ -113,10 +225,23 @@ namespace assign2
             {
                 return m_data + m_size;
             }
+            
+            [[nodiscard]] inline Scalar* data() const
+            {
+                return m_data;
+            }
+            
+            /**
+             * @return a view of the elements [offset, offset + count)
+             */
+            [[nodiscard]] inline weight_view sub_view(blt::size_t offset, blt::size_t count) const
+            {
+                return {m_data + offset, count};
+            }
         
         private:
-            Scalar* m_data;
-            blt::size_t m_size;
+            Scalar* m_data = nullptr;
+            blt::size_t m_size = 0;
     };
     
     /**
@@ -153,6 +278,11 @@ namespace assign2
                 return {&data[size], count};
             }
             
+            [[nodiscard]] inline blt::size_t size() const
+            {
+                return data.size();
+            }
+            
             void debug() const
             {
                 std::cout << "Weights: ";
@@ -164,8 +294,12 @@ namespace assign2
             std::vector<Scalar> data;
     };
     
+    /**
+     * @return the path of every .out file under path
+     */
     inline std::vector<std::string> get_data_files(std::string_view path)
     {
+        ASSIGN2_PROFILE_SCOPE("get_data_files");
         std::vector<std::string> files;
         
         for (const auto& file : std::filesystem::recursive_directory_iterator(path))
@@ -174,75 +308,103 @@ namespace assign2
                 continue;
             auto file_path = file.path().string();
             if (blt::string::ends_with(file_path, ".out"))
-                files.push_back(blt::fs::getFile(file_path));
+                files.push_back(file_path);
         }
         
         return files;
     }
     
-    inline std::vector<data_file_t> load_data_files(const std::vector<std::string>& files)
+    /**
+     * parses the contents of a .out file in a single pass straight out of text, which can be a mapped file. the bins of every point
+     * are stored one after another in a single buffer owned by the returned file's storage. lines which don't have a label
+     * followed by exactly the number of bins given in the header are skipped.
+     */
+    inline data_file_t parse_data_file(std::string_view text)
     {
-        std::vector<data_file_t> loaded_data;
+        const auto* ptr = text.data();
+        const auto* const end = text.data() + text.size();
         
-        // load all file
-        for (auto file : files)
+        const auto is_space = [](char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        };
+        const auto skip_spaces = [&]() {
+            while (ptr != end && is_space(*ptr))
+                ++ptr;
+        };
+        const auto skip_line = [&]() {
+            while (ptr != end && *ptr != '\n')
+                ++ptr;
+            if (ptr != end)
+                ++ptr;
+        };
+        
+        blt::size_t point_count = 0;
+        blt::size_t bin_count = 0;
+        skip_spaces();
+        auto [count_end, count_error] = std::from_chars(ptr, end, point_count);
+        if (count_error != std::errc{})
+            throw std::runtime_error("Data file is missing its 'count bins' header");
+        ptr = count_end;
+        skip_spaces();
+        auto [bins_end, bins_error] = std::from_chars(ptr, end, bin_count);
+        if (bins_error != std::errc{})
+            throw std::runtime_error("Data file is missing its 'count bins' header");
+        ptr = bins_end;
+        skip_line();
+        
+        auto bins = std::make_shared<std::vector<Scalar>>();
+        std::vector<bool> labels;
+        bins->reserve(point_count * bin_count);
+        labels.reserve(point_count);
+        
+        while (ptr != end)
         {
-            // we only use unix line endings here...
-            blt::string::replaceAll(file, "\r", "");
-            auto lines = blt::string::split(file, "\n");
-            auto line_it = lines.begin();
-            auto meta = blt::string::split(*line_it, ' ');
-            
-            // load data inside files
-            data_file_t data;
-            data.data_points.reserve(std::stoll(meta[0]));
-            auto bin_count = std::stoul(meta[1]);
+            skip_spaces();
+            blt::i32 label = 0;
+            auto [label_end, label_error] = std::from_chars(ptr, end, label);
+            if (label_error != std::errc{})
+            {
+                skip_line();
+                continue;
+            }
+            ptr = label_end;
             
-            for (++line_it; line_it != lines.end(); ++line_it)
+            const auto line_start = bins->size();
+            blt::size_t count = 0;
+            while (true)
             {
-                auto line_data_meta = blt::string::split(*line_it, ' ');
-                if (line_data_meta.size() != bin_count + 1)
-                    continue;
-                auto line_data_it = line_data_meta.begin();
-                
-                // load bins
-                data_t line_data;
-                line_data.is_bad = std::stoi(*line_data_it) == 1;
-                line_data.bins.reserve(bin_count);
-                Scalar total = 0;
-                Scalar min = 1000;
-                Scalar max = 0;
-                for (++line_data_it; line_data_it != line_data_meta.end(); ++line_data_it)
+                skip_spaces();
+                if (ptr == end || *ptr == '\n')
+                    break;
+                Scalar v;
+                auto [value_end, value_error] = std::from_chars(ptr, end, v);
+                if (value_error != std::errc{})
                 {
-                    auto v = std::stof(*line_data_it);
-                    if (v > max)
-                        max = v;
-                    if (v < min)
-                        min = v;
-                    total += v * v;
-                    line_data.bins.push_back(v);
+                    // anything that isn't a number makes the line invalid
+                    count = 0;
+                    break;
                 }
-                
-                // normalize vector.
-                total = std::sqrt(total);
-//
-//                for (auto& v : line_data.bins)
-//                {
-//                    v /= total;
-//                    v *= 2.71828;
-//                    v -= 2.71828 / 2;
-//                }
-//
-//            if (line_data.bins.size() == 32)
-//                print_vec(line_data.bins) << std::endl;
-                
-                data.data_points.push_back(line_data);
+                ptr = value_end;
+                bins->push_back(v);
+                count++;
             }
+            skip_line();
             
-            loaded_data.push_back(data);
+            if (count != bin_count)
+            {
+                bins->resize(line_start);
+                continue;
+            }
+            labels.push_back(label == 1);
         }
         
-        return loaded_data;
+        // the buffer is done growing so it is now safe to point into it
+        data_file_t data;
+        data.data_points.reserve(labels.size());
+        for (blt::size_t i = 0; i < labels.size(); i++)
+            data.data_points.push_back({labels[i], span<const Scalar>{bins->data() + i * bin_count, bin_count}});
+        data.storage = std::move(bins);
+        return data;
     }
     
     inline void save_as_csv(const std::string& file, const std::vector<std::pair<std::string, std::vector<Scalar>>>& data)
@@ -269,11 +431,20 @@ namespace assign2
         }
     }
     
-    inline bool is_thinks_bad(const std::vector<Scalar>& out)
+    /**
+     * for outputs computed in another type, see precision.h
+     */
+    template<typename T>
+    bool is_thinks_bad(span<const T> out)
     {
         return out[0] < out[1];
     }
     
+    inline bool is_thinks_bad(span<const Scalar> out)
+    {
+        return is_thinks_bad<Scalar>(out);
+    }
+    
 }
 
 #endif //COSC_4P80_ASSIGNMENT_2_COMMON_H
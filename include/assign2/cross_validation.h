@@ -0,0 +1,149 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_CROSS_VALIDATION_H
+#define COSC_4P80_ASSIGNMENT_2_CROSS_VALIDATION_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/metrics.h>
+#include <assign2/parallel.h>
+#include <algorithm>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * splits file into k groups with the good and bad points spread proportionally over them, shuffled with rand first
+     */
+    template<typename Random>
+    std::vector<data_file_t> make_groups(const data_file_t& file, blt::size_t k, Random& rand)
+    {
+        ASSIGN2_PROFILE_SCOPE("make_groups");
+        std::vector<data_t> goods;
+        // Big Airship of Doom (BAD)
+        std::vector<data_t> bads;
+        
+        for (auto& p : file.data_points)
+        {
+            if (p.is_bad)
+                bads.push_back(p);
+            else
+                goods.push_back(p);
+        }
+        
+        // can randomize the order of good and bad inputs
+        std::shuffle(goods.begin(), goods.end(), rand);
+        std::shuffle(bads.begin(), bads.end(), rand);
+        
+        std::vector<data_file_t> groups;
+        for (blt::size_t i = 0; i < k; i++)
+            groups.emplace_back().storage = file.storage;
+        
+        // then copy proportionally into the groups, creating roughly equal groups of data.
+        // my previous setup randomly selected the group index
+        // this resulted in wildly uneven groups, if you got unlucky.
+        // 25 vs 13 in some groups
+        // not sure if this is what we want, but it felt like this would create issues
+        blt::size_t select = 0;
+        for (auto& v : goods)
+        {
+            ++select %= k;
+            groups[select].data_points.push_back(v);
+        }
+        
+        // because bad motors are in a separate step they are still proportional
+        for (auto& v : bads)
+        {
+            ++select %= k;
+            groups[select].data_points.push_back(v);
+        }
+        return groups;
+    }
+    
+    /**
+     * @return {training, testing} where group k is held out for testing. with a single group we test on what we train on.
+     */
+    inline std::pair<data_file_t, data_file_t> make_fold(const std::vector<data_file_t>& groups, blt::size_t k)
+    {
+        ASSIGN2_PROFILE_SCOPE("make_fold");
+        if (groups.size() < 2)
+            return {groups.front(), groups.front()};
+        
+        data_file_t training;
+        data_file_t testing;
+        // every group is cut out of the same file so they all share its storage
+        training.storage = groups[k].storage;
+        testing.storage = groups[k].storage;
+        
+        testing.data_points.insert(testing.data_points.begin(), groups[k].data_points.begin(), groups[k].data_points.end());
+        
+        for (auto [i, a] : blt::enumerate(groups))
+        {
+            if (i == k)
+                continue;
+            training.data_points.insert(training.data_points.begin(), a.data_points.begin(), a.data_points.end());
+        }
+        
+        return {training, testing};
+    }
+    
+    struct cross_validation_result_t
+    {
+        std::vector<training_metrics_t> folds;
+        training_metrics_t mean;
+    };
+    
+    /**
+     * trains and evaluates one network per fold, with the folds running concurrently over thread_count threads.
+     * every fold reads from the same groups, which must not change until this returns.
+     * @param create makes a fresh network, it is called once per fold on the calling thread before any training starts since
+     * network creation touches shared state (the initializers and layer_id_counter)
+     * @param batch_size if set train with mini-batches of this size instead of per-sample SGD
+     */
+    template<typename NetworkFactory>
+    cross_validation_result_t cross_validate(const std::vector<data_file_t>& groups, NetworkFactory&& create, blt::size_t epochs,
+                                             blt::size_t thread_count = default_thread_count(), std::optional<blt::size_t> batch_size = {})
+    {
+        const auto fold_count = groups.size();
+        std::vector<std::pair<data_file_t, data_file_t>> folds;
+        std::vector<network_t> networks;
+        folds.reserve(fold_count);
+        networks.reserve(fold_count);
+        for (blt::size_t k = 0; k < fold_count; k++)
+        {
+            folds.push_back(make_fold(groups, k));
+            networks.push_back(create());
+        }
+        
+        cross_validation_result_t result;
+        result.folds.resize(fold_count);
+        run_parallel(fold_count, thread_count, [&](blt::size_t k) {
+            auto& metrics = result.folds[k];
+            metrics.reserve(epochs);
+            for (blt::size_t epoch = 0; epoch < epochs; epoch++)
+                train_and_evaluate(networks[k], folds[k].first, folds[k].second, metrics, batch_size);
+        });
+        result.mean = training_metrics_t::mean(result.folds);
+        return result;
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_CROSS_VALIDATION_H
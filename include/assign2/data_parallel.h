@@ -0,0 +1,145 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_DATA_PARALLEL_H
+#define COSC_4P80_ASSIGNMENT_2_DATA_PARALLEL_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/kernels.h>
+#include <assign2/parallel.h>
+#include <algorithm>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * synchronous data-parallel mini-batch training. each batch is cut into one contiguous slice per thread, every thread computes
+     * the gradients of its slice, thread 0 on the network itself and the rest on replicas sharing its weights. the gradients are
+     * then summed into the network with a tree reduction and the network applies a single update, so its momentum and epoch state
+     * are the same as after network_t::train_batch. the slices, the reduction order and the arithmetic are all fixed by the thread
+     * count so for a given thread count and seed the result is bit for bit the same on every run.
+     */
+    class data_parallel_trainer_t
+    {
+        public:
+            data_parallel_trainer_t(network_t& network, blt::size_t thread_count): network(network), pool(thread_count)
+            {
+                replicas.reserve(thread_count - 1);
+                for (blt::size_t i = 1; i < thread_count; i++)
+                {
+                    replicas.push_back(network.clone());
+                    replicas.back().share_weights(network);
+                }
+                errors.resize(thread_count);
+            }
+            
+            /**
+             * @param batch_size samples per update, 0 uses all the data as one batch
+             * @return the average error over the epoch
+             */
+            error_data_t train_epoch(const data_file_t& data, blt::size_t batch_size)
+            {
+                const span<const data_t> points{data.data_points};
+                if (batch_size == 0)
+                    batch_size = points.size();
+                
+                error_data_t error{0, 0};
+                for (blt::size_t offset = 0; offset < points.size(); offset += batch_size)
+                    error += train_batch(points.subspan(offset, batch_size));
+                return network.finish_epoch(error, points.size());
+            }
+            
+            /**
+             * computes the gradient of the whole batch across every thread then applies it once
+             * @return the summed error of the batch
+             */
+            error_data_t train_batch(span<const data_t> batch)
+            {
+                const auto thread_count = pool.size();
+                const auto scale = learn_rate / static_cast<Scalar>(batch.size());
+                
+                pool.run([&](blt::size_t t) {
+                    const auto begin = batch.size() * t / thread_count;
+                    const auto end = batch.size() * (t + 1) / thread_count;
+                    auto& replica = replica_of(t);
+                    if (begin == end)
+                    {
+                        // more threads than samples, contribute nothing to the sum
+                        errors[t] = {0, 0};
+                        for (blt::size_t l = 0; l < replica.layer_count(); l++)
+                        {
+                            auto gradients = replica.layer(l).gradients();
+                            std::fill(gradients.begin(), gradients.end(), 0);
+                        }
+                        return;
+                    }
+                    errors[t] = replica.compute_gradients(batch.subspan(begin, end - begin), scale);
+                });
+                
+                reduce();
+                network.apply_gradients();
+                
+                error_data_t error{0, 0};
+                for (const auto& e : errors)
+                    error += e;
+                return error;
+            }
+        
+        private:
+            network_t& replica_of(blt::size_t t)
+            {
+                return t == 0 ? network : replicas[t - 1];
+            }
+            
+            /**
+             * pairwise tree reduction of every thread's gradients into the network, which is thread 0's. at each level thread i adds
+             * in thread i + stride for every i that is a multiple of 2 * stride, the pairs at a level are independent so they are
+             * summed in parallel on the pool.
+             */
+            void reduce()
+            {
+                const auto thread_count = pool.size();
+                const auto& k = kernels();
+                for (blt::size_t stride = 1; stride < thread_count; stride *= 2)
+                {
+                    const auto pairs = (thread_count - stride + 2 * stride - 1) / (2 * stride);
+                    pool.run([&](blt::size_t pair) {
+                        if (pair >= pairs)
+                            return;
+                        const auto into = pair * 2 * stride;
+                        const auto from = into + stride;
+                        for (blt::size_t l = 0; l < network.layer_count(); l++)
+                        {
+                            const auto dst = replica_of(into).layer(l).gradients();
+                            const auto src = replica_of(from).layer(l).gradients();
+                            k.axpy(dst.data(), src.data(), 1, dst.size());
+                        }
+                    });
+                }
+            }
+            
+            network_t& network;
+            thread_pool_t pool;
+            // replicas[t - 1] is thread t's, thread 0 uses the network
+            std::vector<network_t> replicas;
+            std::vector<error_data_t> errors;
+    };
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_DATA_PARALLEL_H
@@ -0,0 +1,321 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_DATASET_H
+#define COSC_4P80_ASSIGNMENT_2_DATASET_H
+
+#include <assign2/common.h>
+#include <assign2/parallel.h>
+#include <blt/std/logging.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace assign2
+{
+    /**
+     * a private mapping of an entire file, unmapped when destroyed
+     */
+    class mapped_file_t
+    {
+        public:
+            /**
+             * @param copy_on_write also allow writing to the mapping, the first write to a page gives us a private copy of it and
+             * nothing is ever written back to the file. until then the pages are shared with every other process mapping the file
+             * @return the mapped file or nullptr if it couldn't be opened or is empty
+             */
+            static std::shared_ptr<mapped_file_t> open(const std::string& path, bool copy_on_write = false)
+            {
+                auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    return nullptr;
+                struct stat info{};
+                if (::fstat(fd, &info) < 0 || info.st_size <= 0)
+                {
+                    ::close(fd);
+                    return nullptr;
+                }
+                auto size = static_cast<blt::size_t>(info.st_size);
+                auto ptr = ::mmap(nullptr, size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+                // the mapping holds its own reference to the file
+                ::close(fd);
+                if (ptr == MAP_FAILED)
+                    return nullptr;
+                return std::shared_ptr<mapped_file_t>(new mapped_file_t(static_cast<char*>(ptr), size));
+            }
+            
+            mapped_file_t(const mapped_file_t&) = delete;
+            
+            mapped_file_t& operator=(const mapped_file_t&) = delete;
+            
+            [[nodiscard]] const char* data() const
+            {
+                return m_data;
+            }
+            
+            /**
+             * only writable if opened copy on write
+             */
+            [[nodiscard]] char* mutable_data() const
+            {
+                return m_data;
+            }
+            
+            [[nodiscard]] blt::size_t size() const
+            {
+                return m_size;
+            }
+            
+            ~mapped_file_t()
+            {
+                ::munmap(m_data, m_size);
+            }
+        
+        private:
+            mapped_file_t(char* data, blt::size_t size): m_data(data), m_size(size)
+            {}
+            
+            char* m_data;
+            blt::size_t m_size;
+    };
+    
+    /*
+     * the dataset cache is written next to each .out file as <file>.out.cache, in native byte order:
+     *  header          dataset_cache_header_t
+     *  labels          one bit per point, set if the point is bad
+     *  features        point_count x bin_count float32 matrix, one point per row, starting on a 64 byte boundary
+     * the cache is used if the source's size and mtime match the header, or if they don't but the source still hashes the same.
+     */
+    
+    struct dataset_cache_header_t
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t scalar_size;
+        std::uint64_t source_size;
+        std::int64_t source_mtime;
+        std::uint64_t source_hash;
+        std::uint64_t point_count;
+        std::uint64_t bin_count;
+        std::uint64_t labels_offset;
+        std::uint64_t features_offset;
+    };
+    
+    inline constexpr char dataset_cache_magic[8] = {'A', '2', 'D', 'A', 'T', 'A', 'S', 'T'};
+    inline constexpr std::uint32_t dataset_cache_version = 1;
+    inline constexpr blt::size_t dataset_cache_alignment = 64;
+    
+    /**
+     * 64 bit FNV-1a
+     */
+    inline std::uint64_t hash_bytes(std::string_view bytes)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (auto c : bytes)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+    
+    inline std::string dataset_cache_path(const std::string& source)
+    {
+        return source + ".cache";
+    }
+    
+    /**
+     * @return the points stored in a mapped cache file, with every bin pointing straight into the mapping. nothing if the mapping
+     * isn't a complete cache
+     */
+    inline std::optional<data_file_t> read_dataset_cache(const std::shared_ptr<mapped_file_t>& mapping)
+    {
+        if (mapping->size() < sizeof(dataset_cache_header_t))
+            return {};
+        dataset_cache_header_t header{};
+        std::memcpy(&header, mapping->data(), sizeof(header));
+        if (std::memcmp(header.magic, dataset_cache_magic, sizeof(header.magic)) != 0 || header.version != dataset_cache_version ||
+            header.scalar_size != sizeof(Scalar) || header.features_offset % dataset_cache_alignment != 0)
+            return {};
+        // the counts and offsets come from the file, so the checks are written so that they can't overflow
+        const auto size = mapping->size();
+        const auto label_bytes = header.point_count / 8 + (header.point_count % 8 != 0);
+        if (header.labels_offset > size || label_bytes > size - header.labels_offset || header.features_offset > size)
+            return {};
+        const auto feature_space = (size - header.features_offset) / sizeof(Scalar);
+        if (header.bin_count != 0 && header.point_count > feature_space / header.bin_count)
+            return {};
+        // never written, a source without points is an error load_data_file reports
+        if (header.point_count == 0)
+            return {};
+        
+        const auto labels = reinterpret_cast<const unsigned char*>(mapping->data() + header.labels_offset);
+        const auto features = reinterpret_cast<const Scalar*>(mapping->data() + header.features_offset);
+        data_file_t data;
+        data.data_points.reserve(header.point_count);
+        for (blt::size_t i = 0; i < header.point_count; i++)
+        {
+            const bool is_bad = (labels[i / 8] >> (i % 8)) & 1;
+            data.data_points.push_back({is_bad, span<const Scalar>{features + i * header.bin_count, header.bin_count}});
+        }
+        data.storage = mapping;
+        return data;
+    }
+    
+    /**
+     * writes data as a cache for the source file, going through a temporary file so a reader never sees half a cache
+     * @return false if the cache couldn't be written, e.g. the data directory is read only
+     */
+    inline bool write_dataset_cache(const std::string& cache_path, const data_file_t& data, const struct stat& source, std::uint64_t source_hash)
+    {
+        const auto bin_count = data.data_points.empty() ? 0 : data.data_points.front().bins.size();
+        dataset_cache_header_t header{};
+        std::memcpy(header.magic, dataset_cache_magic, sizeof(header.magic));
+        header.version = dataset_cache_version;
+        header.scalar_size = sizeof(Scalar);
+        header.source_size = static_cast<std::uint64_t>(source.st_size);
+        header.source_mtime = static_cast<std::int64_t>(source.st_mtim.tv_sec) * 1000000000 + source.st_mtim.tv_nsec;
+        header.source_hash = source_hash;
+        header.point_count = data.data_points.size();
+        header.bin_count = bin_count;
+        header.labels_offset = sizeof(header);
+        const auto label_bytes = (header.point_count + 7) / 8;
+        header.features_offset = (header.labels_offset + label_bytes + dataset_cache_alignment - 1) / dataset_cache_alignment *
+                                 dataset_cache_alignment;
+        
+        std::vector<unsigned char> labels(label_bytes, 0);
+        for (auto [i, d] : blt::enumerate(data.data_points))
+        {
+            if (d.is_bad)
+                labels[i / 8] |= static_cast<unsigned char>(1u << (i % 8));
+        }
+        
+        // a unique name so processes loading the same data at once don't write over each other's temporary file
+        auto temp_path = cache_path + ".XXXXXX";
+        auto fd = ::mkstemp(temp_path.data());
+        if (fd < 0)
+            return false;
+        // mkstemp only lets the owner read it, the cache is as readable as the data it caches
+        ::fchmod(fd, 0644);
+        auto file = ::fdopen(fd, "wb");
+        if (file == nullptr)
+        {
+            ::close(fd);
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && std::fwrite(labels.data(), 1, labels.size(), file) == labels.size();
+        const std::vector<char> padding(header.features_offset - header.labels_offset - label_bytes, 0);
+        ok = ok && std::fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+        for (const auto& d : data.data_points)
+            ok = ok && d.bins.size() == bin_count && std::fwrite(d.bins.data(), sizeof(Scalar), bin_count, file) == bin_count;
+        // synced before the rename so a crash can't leave a cache in place whose contents never made it to disk
+        ok = ok && std::fflush(file) == 0 && ::fsync(::fileno(file)) == 0;
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temp_path.c_str(), cache_path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+    
+    /**
+     * loads a .out file through its binary cache, making or refreshing the cache if it is missing or stale
+     * @throws std::runtime_error if the file can't be read or has no points
+     */
+    inline data_file_t load_data_file(const std::string& path)
+    {
+        struct stat source{};
+        if (::stat(path.c_str(), &source) < 0)
+            throw std::runtime_error("Unable to stat data file '" + path + "'");
+        if (source.st_size == 0)
+            throw std::runtime_error("Data file '" + path + "' is empty");
+        const auto mtime = static_cast<std::int64_t>(source.st_mtim.tv_sec) * 1000000000 + source.st_mtim.tv_nsec;
+        const auto cache_path = dataset_cache_path(path);
+        
+        std::optional<data_file_t> cached;
+        dataset_cache_header_t header{};
+        if (auto mapping = mapped_file_t::open(cache_path))
+        {
+            cached = read_dataset_cache(mapping);
+            if (cached)
+            {
+                std::memcpy(&header, mapping->data(), sizeof(header));
+                if (header.source_size == static_cast<std::uint64_t>(source.st_size) && header.source_mtime == mtime)
+                    return std::move(*cached);
+            }
+        }
+        
+        auto source_mapping = mapped_file_t::open(path);
+        if (source_mapping == nullptr)
+            throw std::runtime_error("Unable to read data file '" + path + "'");
+        const std::string_view contents{source_mapping->data(), source_mapping->size()};
+        const auto hash = hash_bytes(contents);
+        if (cached && header.source_hash == hash)
+        {
+            // only the timestamp changed, bring the header up to date so we don't hash the file again next time
+            header.source_size = static_cast<std::uint64_t>(source.st_size);
+            header.source_mtime = mtime;
+            auto fd = ::open(cache_path.c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                if (::pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)))
+                    BLT_WARN("Unable to update dataset cache '%s'", cache_path.c_str());
+                ::close(fd);
+            }
+            return std::move(*cached);
+        }
+        
+        auto data = parse_data_file(contents);
+        // everything after loading sizes its network from the first point
+        if (data.data_points.empty())
+            throw std::runtime_error("Data file '" + path + "' has no data points");
+        if (!write_dataset_cache(cache_path, data, source, hash))
+            BLT_WARN("Unable to write dataset cache '%s', the text will be parsed again next run", cache_path.c_str());
+        return data;
+    }
+    
+    inline std::vector<data_file_t> load_data_files(const std::vector<std::string>& files)
+    {
+        ASSIGN2_PROFILE_SCOPE("load_data_files");
+        std::vector<data_file_t> loaded_data(files.size());
+        // files are independent of each other so they are all loaded at once
+        run_parallel(files.size(), default_thread_count(), [&](blt::size_t i) {
+            ASSIGN2_PROFILE_SCOPE("load_data_file");
+            loaded_data[i] = load_data_file(files[i]);
+        });
+        return loaded_data;
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_DATASET_H
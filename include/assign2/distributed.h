@@ -0,0 +1,305 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_DISTRIBUTED_H
+#define COSC_4P80_ASSIGNMENT_2_DISTRIBUTED_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace assign2
+{
+    /*
+     * multi-process training with parameter averaging. every worker process trains its own shard of the data and after each
+     * round sends its parameters to the coordinator over a unix domain socket, the coordinator averages what it received from
+     * every worker and sends the average back to all of them.
+     *
+     * a round on the wire is a std::uint64_t count followed by count floats in each direction. a worker sending a count of 0 is
+     * finished, once every worker has finished the coordinator returns.
+     */
+    
+    inline std::runtime_error socket_error(const std::string& what)
+    {
+        return std::runtime_error(what + ": " + std::strerror(errno));
+    }
+    
+    /**
+     * writes every byte to the socket fd. a peer that went away is reported as an error rather than raising SIGPIPE, which would
+     * otherwise kill the process
+     */
+    inline void write_all(int fd, const void* data, blt::size_t bytes)
+    {
+        auto ptr = static_cast<const char*>(data);
+        while (bytes > 0)
+        {
+            auto written = ::send(fd, ptr, bytes, MSG_NOSIGNAL);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw socket_error("Failed to write to socket");
+            }
+            ptr += written;
+            bytes -= static_cast<blt::size_t>(written);
+        }
+    }
+    
+    inline void read_all(int fd, void* data, blt::size_t bytes)
+    {
+        auto ptr = static_cast<char*>(data);
+        while (bytes > 0)
+        {
+            auto amount = ::read(fd, ptr, bytes);
+            if (amount < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw socket_error("Failed to read from socket");
+            }
+            if (amount == 0)
+                throw std::runtime_error("Socket closed in the middle of a message");
+            ptr += amount;
+            bytes -= static_cast<blt::size_t>(amount);
+        }
+    }
+    
+    inline sockaddr_un make_unix_address(const std::string& path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Socket path '" + path + "' is too long");
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+    
+    /**
+     * removes the socket at path. anything else found there is left alone, binding to it then fails instead of deleting the file
+     */
+    inline void unlink_socket(const std::string& path)
+    {
+        struct stat info{};
+        if (::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+            ::unlink(path.c_str());
+    }
+    
+    /**
+     * averages the parameters of a fixed number of workers each round until they have all finished
+     */
+    class coordinator_t
+    {
+        public:
+            /**
+             * starts listening on path, replacing any stale socket file left there. workers can connect as soon as this returns
+             */
+            coordinator_t(std::string path, blt::size_t worker_count): path(std::move(path)), worker_count(worker_count)
+            {
+                auto address = make_unix_address(this->path);
+                listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (listen_fd < 0)
+                    throw socket_error("Failed to create coordinator socket");
+                unlink_socket(this->path);
+                if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+                    throw socket_error("Failed to bind coordinator socket to '" + this->path + "'");
+                if (::listen(listen_fd, static_cast<int>(worker_count)) < 0)
+                    throw socket_error("Failed to listen on coordinator socket");
+            }
+            
+            coordinator_t(const coordinator_t&) = delete;
+            
+            coordinator_t& operator=(const coordinator_t&) = delete;
+            
+            /**
+             * accepts every worker then serves rounds until all of them are finished
+             * @return the number of rounds averaged
+             */
+            blt::size_t run()
+            {
+                while (workers.size() < worker_count)
+                {
+                    auto fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (fd < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        throw socket_error("Failed to accept worker");
+                    }
+                    workers.push_back(fd);
+                }
+                
+                blt::size_t rounds = 0;
+                std::vector<Scalar> incoming;
+                while (true)
+                {
+                    std::uint64_t count = 0;
+                    blt::size_t finished = 0;
+                    for (auto [i, fd] : blt::enumerate(workers))
+                    {
+                        std::uint64_t received = 0;
+                        read_all(fd, &received, sizeof(received));
+                        if (received == 0)
+                        {
+                            finished++;
+                            continue;
+                        }
+                        if (count == 0)
+                        {
+                            count = received;
+                            sum.assign(count, 0);
+                            incoming.resize(count);
+                        }
+                        if (received != count)
+                            throw std::runtime_error("Worker " + std::to_string(i) + " sent " + std::to_string(received) +
+                                                     " parameters but expected " + std::to_string(count));
+                        read_all(fd, incoming.data(), count * sizeof(Scalar));
+                        // always summed in worker order so the average doesn't depend on who finished their epoch first
+                        for (blt::size_t j = 0; j < count; j++)
+                            sum[j] += incoming[j];
+                    }
+                    if (finished == workers.size())
+                        break;
+                    if (finished != 0)
+                        throw std::runtime_error("Workers finished on different rounds");
+                    
+                    for (auto& v : sum)
+                        v /= static_cast<Scalar>(workers.size());
+                    for (auto fd : workers)
+                        write_all(fd, sum.data(), count * sizeof(Scalar));
+                    rounds++;
+                }
+                return rounds;
+            }
+            
+            /**
+             * closes the listening socket without removing its file, for a process forked from the coordinator's that isn't it
+             */
+            void close_listener()
+            {
+                if (listen_fd >= 0)
+                    ::close(listen_fd);
+                listen_fd = -1;
+            }
+            
+            ~coordinator_t()
+            {
+                for (auto fd : workers)
+                    ::close(fd);
+                if (listen_fd >= 0)
+                    ::close(listen_fd);
+                unlink_socket(path);
+            }
+        
+        private:
+            std::string path;
+            blt::size_t worker_count;
+            int listen_fd = -1;
+            std::vector<int> workers;
+            std::vector<Scalar> sum;
+    };
+    
+    /**
+     * a worker's connection to the coordinator
+     */
+    class worker_t
+    {
+        public:
+            /**
+             * connects to the coordinator at path, retrying for a few seconds in case it hasn't started listening yet
+             */
+            explicit worker_t(const std::string& path)
+            {
+                auto address = make_unix_address(path);
+                for (blt::size_t attempt = 0;; attempt++)
+                {
+                    fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                    if (fd < 0)
+                        throw socket_error("Failed to create worker socket");
+                    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+                        break;
+                    ::close(fd);
+                    fd = -1;
+                    if ((errno != ENOENT && errno != ECONNREFUSED) || attempt >= 50)
+                        throw socket_error("Failed to connect to coordinator at '" + path + "'");
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+            }
+            
+            worker_t(const worker_t&) = delete;
+            
+            worker_t& operator=(const worker_t&) = delete;
+            
+            /**
+             * sends our parameters to the coordinator and replaces them with the average over every worker
+             */
+            void average(network_t& network)
+            {
+                std::uint64_t count = network.parameter_count();
+                buffer.resize(count);
+                network.save_parameters(buffer.data());
+                write_all(fd, &count, sizeof(count));
+                write_all(fd, buffer.data(), count * sizeof(Scalar));
+                read_all(fd, buffer.data(), count * sizeof(Scalar));
+                network.load_parameters(buffer.data());
+            }
+            
+            /**
+             * tells the coordinator we won't be sending any more rounds
+             */
+            void finish()
+            {
+                std::uint64_t count = 0;
+                write_all(fd, &count, sizeof(count));
+            }
+            
+            ~worker_t()
+            {
+                if (fd >= 0)
+                    ::close(fd);
+            }
+        
+        private:
+            int fd = -1;
+            std::vector<Scalar> buffer;
+    };
+    
+    /**
+     * @return every worker_count'th point of data starting at rank, the shard worker rank trains on
+     */
+    inline data_file_t make_shard(const data_file_t& data, blt::size_t rank, blt::size_t worker_count)
+    {
+        data_file_t shard;
+        shard.storage = data.storage;
+        for (blt::size_t i = rank; i < data.data_points.size(); i += worker_count)
+            shard.data_points.push_back(data.data_points[i]);
+        return shard;
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_DISTRIBUTED_H
@@ -0,0 +1,225 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_FEATURES_H
+#define COSC_4P80_ASSIGNMENT_2_FEATURES_H
+
+#include <assign2/common.h>
+#include <assign2/dataset.h>
+#include <assign2/parallel.h>
+#include <unsupported/Eigen/FFT>
+#include <algorithm>
+#include <charconv>
+#include <complex>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * a raw time series of one motor and whether that motor is bad
+     */
+    struct recording_t
+    {
+        bool is_bad = false;
+        std::vector<Scalar> samples;
+    };
+    
+    /**
+     * the bin counts of the .out files our networks are trained on
+     */
+    inline const std::vector<blt::size_t> default_bin_counts = {16, 25, 32, 64, 150, 1000};
+    
+    /**
+     * reads a raw recording. these are text files holding the label (1 if the motor is bad, 0 if good) followed by every sample,
+     * separated by any whitespace.
+     */
+    inline recording_t load_recording(const std::string& path)
+    {
+        auto mapping = mapped_file_t::open(path);
+        if (mapping == nullptr)
+            throw std::runtime_error("Unable to read recording '" + path + "'");
+        const auto* ptr = mapping->data();
+        const auto* const end = mapping->data() + mapping->size();
+        const auto skip_spaces = [&]() {
+            while (ptr != end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n'))
+                ++ptr;
+        };
+        
+        recording_t recording;
+        blt::i32 label = 0;
+        skip_spaces();
+        auto [label_end, label_error] = std::from_chars(ptr, end, label);
+        if (label_error != std::errc{})
+            throw std::runtime_error("Recording '" + path + "' doesn't start with a label");
+        ptr = label_end;
+        recording.is_bad = label == 1;
+        
+        // a sample is at least two characters with its separator, so this is never too small by much
+        recording.samples.reserve(mapping->size() / 2);
+        while (true)
+        {
+            skip_spaces();
+            if (ptr == end)
+                break;
+            Scalar v;
+            auto [value_end, value_error] = std::from_chars(ptr, end, v);
+            if (value_error != std::errc{})
+                throw std::runtime_error("Recording '" + path + "' has a sample that isn't a number");
+            ptr = value_end;
+            recording.samples.push_back(v);
+        }
+        recording.samples.shrink_to_fit();
+        return recording;
+    }
+    
+    /**
+     * @return every .sig recording under path
+     */
+    inline std::vector<recording_t> load_recordings(std::string_view path)
+    {
+        std::vector<std::string> files;
+        for (const auto& file : std::filesystem::recursive_directory_iterator(path))
+        {
+            if (!file.is_directory() && file.path().extension() == ".sig")
+                files.push_back(file.path().string());
+        }
+        
+        std::vector<recording_t> recordings(files.size());
+        run_parallel(files.size(), default_thread_count(), [&](blt::size_t i) {
+            recordings[i] = load_recording(files[i]);
+        });
+        return recordings;
+    }
+    
+    /**
+     * shrinks a spectrum to coarse.size() bins by summing it over evenly split bands, bin b covers
+     * [b * fine.size() / coarse.size(), (b + 1) * fine.size() / coarse.size())
+     */
+    inline void band_sum(span<const Scalar> fine, span<Scalar> coarse)
+    {
+        for (blt::size_t b = 0; b < coarse.size(); b++)
+        {
+            const auto band_begin = b * fine.size() / coarse.size();
+            const auto band_end = (b + 1) * fine.size() / coarse.size();
+            coarse[b] = std::accumulate(fine.begin() + band_begin, fine.begin() + band_end, Scalar{0});
+        }
+    }
+    
+    /**
+     * turns recordings into the points of every bin count at once, like the .out files the external FFT tool writes.
+     *
+     * every recording is cut into back to back windows of twice the largest bin count and each window becomes one point of
+     * every bin count. the spectrum of each window is only computed at the finest resolution, the magnitude of its first
+     * max(bin_counts) frequencies, and each coarser bin count is made by summing that spectrum over evenly split bands.
+     * whatever is left at the end of a recording that doesn't fill a window is dropped.
+     *
+     * each recording gets a single buffer holding all of its points at every resolution, window after window, which is shared by
+     * all of the returned files. the windows of every recording are split evenly across thread_count threads.
+     * @return one data file per bin count in the same order as bin_counts, empty if no recording fills a window
+     */
+    inline std::vector<data_file_t> extract_features(const std::vector<recording_t>& recordings,
+                                                     const std::vector<blt::size_t>& bin_counts = default_bin_counts,
+                                                     blt::size_t thread_count = default_thread_count())
+    {
+        struct window_t
+        {
+            blt::size_t recording;
+            blt::size_t offset;
+            Scalar* out;
+        };
+        
+        if (bin_counts.empty())
+            return {};
+        const auto finest = *std::max_element(bin_counts.begin(), bin_counts.end());
+        const auto window_size = finest * 2;
+        // where each bin count sits inside a window's block of the recording buffer, the finest one is always first
+        std::vector<blt::size_t> offsets;
+        blt::size_t per_window = finest;
+        for (auto bin_count : bin_counts)
+        {
+            offsets.push_back(bin_count == finest ? 0 : per_window);
+            if (bin_count != finest)
+                per_window += bin_count;
+        }
+        
+        auto buffers = std::make_shared<std::vector<std::vector<Scalar>>>(recordings.size());
+        std::vector<window_t> windows;
+        for (auto [r, recording] : blt::enumerate(recordings))
+        {
+            const auto count = recording.samples.size() / window_size;
+            auto& buffer = (*buffers)[r];
+            buffer.resize(count * per_window);
+            for (blt::size_t w = 0; w < count; w++)
+                windows.push_back({r, w * window_size, buffer.data() + w * per_window});
+        }
+        
+        thread_count = std::max<blt::size_t>(1, std::min(thread_count, windows.size()));
+        run_parallel(thread_count, thread_count, [&](blt::size_t t) {
+            // the fft caches its plan, so every thread gets its own along with its own output buffer
+            Eigen::FFT<Scalar> fft;
+            fft.SetFlag(Eigen::FFT<Scalar>::HalfSpectrum);
+            std::vector<std::complex<Scalar>> spectrum(window_size / 2 + 1);
+            
+            const auto begin = windows.size() * t / thread_count;
+            const auto end = windows.size() * (t + 1) / thread_count;
+            for (auto i = begin; i < end; i++)
+            {
+                const auto& samples = recordings[windows[i].recording].samples;
+                fft.fwd(spectrum.data(), samples.data() + windows[i].offset, static_cast<Eigen::Index>(window_size));
+                auto* fine = windows[i].out;
+                for (blt::size_t b = 0; b < finest; b++)
+                    fine[b] = std::abs(spectrum[b]);
+                
+                for (auto [j, bin_count] : blt::enumerate(bin_counts))
+                {
+                    if (bin_count == finest)
+                        continue;
+                    band_sum(span<const Scalar>{fine, finest}, span<Scalar>{windows[i].out + offsets[j], bin_count});
+                }
+            }
+        });
+        
+        std::vector<data_file_t> files(bin_counts.size());
+        for (auto [j, bin_count] : blt::enumerate(bin_counts))
+        {
+            auto& file = files[j];
+            file.data_points.reserve(windows.size());
+            for (const auto& window : windows)
+                file.data_points.push_back({recordings[window.recording].is_bad, span<const Scalar>{window.out + offsets[j], bin_count}});
+            file.storage = buffers;
+        }
+        return files;
+    }
+    
+    /**
+     * @return the points of a single bin count, see the overload above
+     */
+    inline data_file_t extract_features(const std::vector<recording_t>& recordings, blt::size_t bin_count,
+                                        blt::size_t thread_count = default_thread_count())
+    {
+        return std::move(extract_features(recordings, std::vector<blt::size_t>{bin_count}, thread_count).front());
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_FEATURES_H
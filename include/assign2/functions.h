@@ -21,30 +21,59 @@
 
 #include <assign2/common.h>
 #include <cmath>
+#include <optional>
+#include <variant>
 
 namespace assign2
 {
+    /*
+     * each function's call() is also a template over the value type, so inference at other precisions (see precision.h) evaluates
+     * the same function in its own arithmetic
+     */
+    
     struct sigmoid_function : public function_t
     {
-        [[nodiscard]] Scalar call(const Scalar s) const final
+        template<typename T>
+        [[nodiscard]] T call(const T s) const
         {
             return 1 / (1 + std::exp(-s));
         }
         
+        [[nodiscard]] Scalar call(const Scalar s) const final
+        {
+            return call<Scalar>(s);
+        }
+        
         [[nodiscard]] Scalar derivative(const Scalar s) const final
         {
             auto v = call(s);
             return v * (1 - v);
         }
+        
+        void apply(span<const Scalar> in, span<Scalar> out) const final
+        {
+            as_array(out) = as_array(in).logistic();
+        }
+        
+        void derivative(span<const Scalar> in, span<Scalar> out) const final
+        {
+            apply(in, out);
+            auto v = as_array(out);
+            v = v * (1 - v);
+        }
     };
     
     struct tanh_function : public function_t
     {
+        template<typename T>
+        [[nodiscard]] T call(const T s) const
+        {
+            return std::tanh(s);
+        }
+        
         [[nodiscard]] Scalar call(Scalar s) const final
         {
-            auto x = std::exp(s);
-            auto nx = std::exp(-s);
-            return (x - nx) / (x + nx);
+            return call<Scalar>(s);
         }
         
         [[nodiscard]] Scalar derivative(Scalar s) const final
@@ -52,33 +81,137 @@ namespace assign2
             auto tanh = std::tanh(s);
             return 1 - (tanh * tanh);
         }
+        
+        void apply(span<const Scalar> in, span<Scalar> out) const final
+        {
+            as_array(out) = as_array(in).tanh();
+        }
+        
+        void derivative(span<const Scalar> in, span<Scalar> out) const final
+        {
+            as_array(out) = 1 - as_array(in).tanh().square();
+        }
     };
     
     struct relu_function : public function_t
     {
+        template<typename T>
+        [[nodiscard]] T call(const T s) const
+        {
+            return std::max(static_cast<T>(0), s);
+        }
+        
         [[nodiscard]] Scalar call(const Scalar s) const final
         {
-            return std::max(static_cast<Scalar>(0), s);
+            return call<Scalar>(s);
         }
         
         [[nodiscard]] Scalar derivative(Scalar s) const final
         {
             return s >= 0 ? 1 : 0;
         }
+        
+        void apply(span<const Scalar> in, span<Scalar> out) const final
+        {
+            as_array(out) = as_array(in).max(static_cast<Scalar>(0));
+        }
+        
+        void derivative(span<const Scalar> in, span<Scalar> out) const final
+        {
+            as_array(out) = (as_array(in) >= 0).cast<Scalar>();
+        }
     };
     
     struct bulu_function : public function_t
     {
+        template<typename T>
+        [[nodiscard]] T call(const T s) const
+        {
+            return s > static_cast<T>(0.5) ? s : -s;
+        }
+        
         [[nodiscard]] Scalar call(const Scalar s) const final
         {
-            return s > 0.5 ? s : -s;
+            return call<Scalar>(s);
         }
         
         [[nodiscard]] Scalar derivative(Scalar s) const final
         {
             return s >= 0 ? 1 : -1;
         }
+        
+        void apply(span<const Scalar> in, span<Scalar> out) const final
+        {
+            auto x = as_array(in);
+            as_array(out) = (x > static_cast<Scalar>(0.5)).select(x, -x);
+        }
+        
+        void derivative(span<const Scalar> in, span<Scalar> out) const final
+        {
+            as_array(out) = (as_array(in) >= 0).cast<Scalar>() * 2 - 1;
+        }
     };
+    
+    /**
+     * the activation used by a layer. holding one of the known functions by value lets the layer be compiled against the concrete
+     * type so the calls inline, function_t* is kept for functions only known at runtime.
+     */
+    using activation_t = std::variant<function_t*, sigmoid_function, tanh_function, relu_function, bulu_function>;
+    
+    /**
+     * calls func with the activation as its concrete type when we know it, otherwise as a function_t&
+     */
+    template<typename Func>
+    void visit_activation(const activation_t& activation, Func&& func)
+    {
+        std::visit([&func](const auto& act) {
+            if constexpr (std::is_pointer_v<std::decay_t<decltype(act)>>)
+                func(*act);
+            else
+                func(act);
+        }, activation);
+    }
+    
+    /**
+     * @return the id model files store the activation as, 0 if it is a function_t* to something other than the built in functions.
+     * these are written to disk so they must never change
+     */
+    inline blt::u32 activation_id(const activation_t& activation)
+    {
+        if (const auto* ptr = std::get_if<function_t*>(&activation))
+        {
+            if (dynamic_cast<const sigmoid_function*>(*ptr))
+                return 1;
+            if (dynamic_cast<const tanh_function*>(*ptr))
+                return 2;
+            if (dynamic_cast<const relu_function*>(*ptr))
+                return 3;
+            if (dynamic_cast<const bulu_function*>(*ptr))
+                return 4;
+            return 0;
+        }
+        return static_cast<blt::u32>(activation.index());
+    }
+    
+    /**
+     * the reverse of activation_id()
+     */
+    inline std::optional<activation_t> make_activation(blt::u32 id)
+    {
+        switch (id)
+        {
+            case 1:
+                return sigmoid_function{};
+            case 2:
+                return tanh_function{};
+            case 3:
+                return relu_function{};
+            case 4:
+                return bulu_function{};
+            default:
+                return {};
+        }
+    }
 }
 
 #endif //COSC_4P80_ASSIGNMENT_2_FUNCTIONS_H
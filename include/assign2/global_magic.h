@@ -33,7 +33,7 @@ namespace assign2
     inline std::atomic_bool pause_mode = true;
     inline std::atomic_bool pause_flag = false;
     
-    void await()
+    inline void await()
     {
         if (!pause_mode.load(std::memory_order_relaxed))
             return;
@@ -61,7 +61,7 @@ namespace assign2
     inline std::vector<Scalar> correct_over_time_test;
     inline std::vector<node_data> nodes;
     
-    void save_error_info(const std::string& name)
+    inline void save_error_info(const std::string& name)
     {
         save_as_csv("network" + name + ".csv", {{"train_error",   errors_over_time},
                                                                         {"train_d_error", error_derivative_over_time},
@@ -0,0 +1,151 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_HOGWILD_H
+#define COSC_4P80_ASSIGNMENT_2_HOGWILD_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/parallel.h>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * lock-free asynchronous SGD (Hogwild). every thread trains its own shard of the data on a replica of the network and all
+     * replicas update the same weights without any locking, so updates from different threads can interleave or be lost.
+     *
+     * by default the replicas read and write the shared weights directly, which is a data race the algorithm tolerates.
+     * with ASSIGN2_HOGWILD_ATOMIC (set by ENABLE_TSAN) each replica instead trains on a private copy which is refreshed from the
+     * shared weights with relaxed atomic loads before every sample, and its change is added back with relaxed atomic stores after.
+     * this has the same semantics but every shared access is visible to the thread sanitizer.
+     */
+    class hogwild_trainer_t
+    {
+        public:
+            hogwild_trainer_t(network_t& network, blt::size_t thread_count): network(network), pool(thread_count)
+            {
+                replicas.reserve(thread_count);
+                for (blt::size_t i = 0; i < thread_count; i++)
+                {
+                    replicas.push_back(network.clone());
+#ifdef ASSIGN2_HOGWILD_ATOMIC
+                    auto& snapshot = snapshots.emplace_back();
+                    for (blt::size_t l = 0; l < network.layer_count(); l++)
+                        snapshot.emplace_back(network.layer(l).parameters().size());
+#else
+                    replicas.back().share_weights(network);
+#endif
+                }
+                errors.resize(thread_count);
+            }
+            
+            /**
+             * trains over every sample in data once, split into one contiguous shard per thread. the replicas reset their momentum
+             * when the network would have, and the epoch's error carries into the network's epoch state like network_t::train_epoch
+             * @return the average error over the epoch
+             */
+            error_data_t train_epoch(const data_file_t& data)
+            {
+                const auto thread_count = pool.size();
+                const span<const data_t> points{data.data_points};
+                const auto reset = network.epoch_state().reset_next;
+                
+                pool.run([&](blt::size_t t) {
+                    const auto begin = points.size() * t / thread_count;
+                    const auto end = points.size() * (t + 1) / thread_count;
+                    auto& replica = replicas[t];
+                    errors[t] = {0, 0};
+                    for (const auto& x : points.subspan(begin, end - begin))
+                    {
+                        pull(t);
+                        errors[t] += replica.train(x, reset);
+                        push(t);
+                    }
+                });
+                
+                error_data_t error{0, 0};
+                for (const auto& e : errors)
+                    error += e;
+                return network.finish_epoch(error, points.size());
+            }
+        
+        private:
+#ifdef ASSIGN2_HOGWILD_ATOMIC
+            static Scalar load_relaxed(const Scalar* v)
+            {
+                Scalar out;
+                __atomic_load(v, &out, __ATOMIC_RELAXED);
+                return out;
+            }
+            
+            static void store_relaxed(Scalar* v, Scalar value)
+            {
+                __atomic_store(v, &value, __ATOMIC_RELAXED);
+            }
+            
+            // copy the shared weights into replica t, remembering what we saw so push() can work out our change
+            void pull(blt::size_t t)
+            {
+                for (blt::size_t l = 0; l < network.layer_count(); l++)
+                {
+                    const auto shared = network.layer(l).parameters();
+                    const auto local = replicas[t].layer(l).parameters();
+                    auto& snapshot = snapshots[t][l];
+                    for (blt::size_t i = 0; i < shared.size(); i++)
+                    {
+                        snapshot[i] = load_relaxed(&shared[i]);
+                        local[i] = snapshot[i];
+                    }
+                }
+            }
+            
+            // add the change replica t made since pull() onto the shared weights. another thread may write between our load and
+            // store, in which case one of the updates is lost. that is the same as what happens in the racing version.
+            void push(blt::size_t t)
+            {
+                for (blt::size_t l = 0; l < network.layer_count(); l++)
+                {
+                    const auto shared = network.layer(l).parameters();
+                    const auto local = replicas[t].layer(l).parameters();
+                    const auto& snapshot = snapshots[t][l];
+                    for (blt::size_t i = 0; i < shared.size(); i++)
+                        store_relaxed(&shared[i], load_relaxed(&shared[i]) + (local[i] - snapshot[i]));
+                }
+            }
+            
+            // per thread, per layer copy of the shared weights as of the last pull
+            std::vector<std::vector<std::vector<Scalar>>> snapshots;
+#else
+            
+            void pull(blt::size_t)
+            {}
+            
+            void push(blt::size_t)
+            {}
+            
+#endif
+            
+            network_t& network;
+            thread_pool_t pool;
+            std::vector<network_t> replicas;
+            std::vector<error_data_t> errors;
+    };
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_HOGWILD_H
@@ -0,0 +1,486 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_KERNELS_H
+#define COSC_4P80_ASSIGNMENT_2_KERNELS_H
+
+#include <assign2/common.h>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define ASSIGN2_X86_KERNELS
+    #include <immintrin.h>
+#endif
+
+namespace assign2
+{
+    /**
+     * the inner loops of the network. everything is written against raw pointers so the compiler doesn't have to see through
+     * the iterator abstractions, and the x86 versions are compiled per ISA then picked once at runtime from what the CPU supports.
+     */
+    struct kernels_t
+    {
+        const char* name;
+        // returns sum(a[i] * b[i])
+        Scalar (* dot)(const Scalar* a, const Scalar* b, blt::size_t count);
+        // out[i] = alpha * x[i], used to write one row of the dw outer product
+        void (* scale)(Scalar* out, const Scalar* x, Scalar alpha, blt::size_t count);
+        // y[i] += alpha * x[i]
+        void (* axpy)(Scalar* y, const Scalar* x, Scalar alpha, blt::size_t count);
+        // m[i] = omega == 0 ? 0 : m[i] + omega * d[i]; w[i] += m[i] + d[i]
+        void (* momentum_update)(Scalar* w, Scalar* m, const Scalar* d, Scalar omega, blt::size_t count);
+    };
+
+    /**
+     * the integer kernels of the quantized inference path, see quantize.h
+     */
+    struct int8_kernels_t
+    {
+        const char* name;
+        // returns sum(a[i] * b[i]) accumulated in 32 bits. a must be at most 127 so pmaddubsw's pairwise 16 bit sums can't
+        // saturate, which keeps every version bit-identical
+        std::int32_t (* dot)(const std::uint8_t* a, const std::int8_t* b, blt::size_t count);
+    };
+
+    /**
+     * dot products of half precision weights with float inputs, accumulated in float. see precision.h
+     */
+    struct half_kernels_t
+    {
+        const char* name;
+        Scalar (* dot_fp16)(const Eigen::half* w, const Scalar* x, blt::size_t count);
+        Scalar (* dot_bf16)(const Eigen::bfloat16* w, const Scalar* x, blt::size_t count);
+    };
+
+    namespace scalar_kernels
+    {
+        inline Scalar dot(const Scalar* a, const Scalar* b, blt::size_t count)
+        {
+            Scalar sum = 0;
+            for (blt::size_t i = 0; i < count; i++)
+                sum += a[i] * b[i];
+            return sum;
+        }
+
+        inline void scale(Scalar* out, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            for (blt::size_t i = 0; i < count; i++)
+                out[i] = alpha * x[i];
+        }
+
+        inline void axpy(Scalar* y, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            for (blt::size_t i = 0; i < count; i++)
+                y[i] += alpha * x[i];
+        }
+
+        inline void momentum_update(Scalar* w, Scalar* m, const Scalar* d, Scalar omega, blt::size_t count)
+        {
+            // if omega is zero we are not using momentum.
+            if (omega == 0)
+            {
+                for (blt::size_t i = 0; i < count; i++)
+                {
+                    m[i] = 0;
+                    w[i] += d[i];
+                }
+                return;
+            }
+            for (blt::size_t i = 0; i < count; i++)
+            {
+                m[i] += omega * d[i];
+                w[i] += m[i] + d[i];
+            }
+        }
+
+        inline std::int32_t dot_u8s8(const std::uint8_t* a, const std::int8_t* b, blt::size_t count)
+        {
+            std::int32_t sum = 0;
+            for (blt::size_t i = 0; i < count; i++)
+                sum += static_cast<std::int32_t>(a[i]) * static_cast<std::int32_t>(b[i]);
+            return sum;
+        }
+
+        template<typename Half>
+        inline Scalar dot_half(const Half* w, const Scalar* x, blt::size_t count)
+        {
+            Scalar sum = 0;
+            for (blt::size_t i = 0; i < count; i++)
+                sum += static_cast<Scalar>(w[i]) * x[i];
+            return sum;
+        }
+    }
+
+#ifdef ASSIGN2_X86_KERNELS
+
+    namespace sse2_kernels
+    {
+        __attribute__((target("sse2"))) inline Scalar dot(const Scalar* a, const Scalar* b, blt::size_t count)
+        {
+            __m128 acc0 = _mm_setzero_ps();
+            __m128 acc1 = _mm_setzero_ps();
+            blt::size_t i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+            }
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, _mm_add_ps(acc0, acc1));
+            Scalar sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+            for (; i < count; i++)
+                sum += a[i] * b[i];
+            return sum;
+        }
+
+        __attribute__((target("sse2"))) inline void scale(Scalar* out, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            const __m128 a = _mm_set1_ps(alpha);
+            blt::size_t i = 0;
+            for (; i + 4 <= count; i += 4)
+                _mm_storeu_ps(out + i, _mm_mul_ps(a, _mm_loadu_ps(x + i)));
+            for (; i < count; i++)
+                out[i] = alpha * x[i];
+        }
+
+        __attribute__((target("sse2"))) inline void axpy(Scalar* y, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            const __m128 a = _mm_set1_ps(alpha);
+            blt::size_t i = 0;
+            for (; i + 4 <= count; i += 4)
+                _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a, _mm_loadu_ps(x + i))));
+            for (; i < count; i++)
+                y[i] += alpha * x[i];
+        }
+
+        __attribute__((target("sse2"))) inline void momentum_update(Scalar* w, Scalar* m, const Scalar* d, Scalar omega, blt::size_t count)
+        {
+            const __m128 o = _mm_set1_ps(omega);
+            const bool use_momentum = omega != 0;
+            blt::size_t i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                const __m128 dv = _mm_loadu_ps(d + i);
+                const __m128 mv = use_momentum ? _mm_add_ps(_mm_loadu_ps(m + i), _mm_mul_ps(o, dv)) : _mm_setzero_ps();
+                _mm_storeu_ps(m + i, mv);
+                _mm_storeu_ps(w + i, _mm_add_ps(_mm_loadu_ps(w + i), _mm_add_ps(mv, dv)));
+            }
+            scalar_kernels::momentum_update(w + i, m + i, d + i, omega, count - i);
+        }
+    }
+
+    namespace avx2_kernels
+    {
+        __attribute__((target("avx2,fma"))) inline Scalar dot(const Scalar* a, const Scalar* b, blt::size_t count)
+        {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            blt::size_t i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+            }
+            for (; i + 8 <= count; i += 8)
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+            const __m256 acc = _mm256_add_ps(acc0, acc1);
+            __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+            half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 0x55));
+            Scalar sum = _mm_cvtss_f32(half);
+            for (; i < count; i++)
+                sum += a[i] * b[i];
+            return sum;
+        }
+
+        __attribute__((target("avx2,fma"))) inline void scale(Scalar* out, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            const __m256 a = _mm256_set1_ps(alpha);
+            blt::size_t i = 0;
+            for (; i + 8 <= count; i += 8)
+                _mm256_storeu_ps(out + i, _mm256_mul_ps(a, _mm256_loadu_ps(x + i)));
+            for (; i < count; i++)
+                out[i] = alpha * x[i];
+        }
+
+        __attribute__((target("avx2,fma"))) inline void axpy(Scalar* y, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            const __m256 a = _mm256_set1_ps(alpha);
+            blt::size_t i = 0;
+            for (; i + 8 <= count; i += 8)
+                _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+            for (; i < count; i++)
+                y[i] += alpha * x[i];
+        }
+
+        __attribute__((target("avx2,fma"))) inline void momentum_update(Scalar* w, Scalar* m, const Scalar* d, Scalar omega, blt::size_t count)
+        {
+            const __m256 o = _mm256_set1_ps(omega);
+            const bool use_momentum = omega != 0;
+            blt::size_t i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                const __m256 dv = _mm256_loadu_ps(d + i);
+                const __m256 mv = use_momentum ? _mm256_fmadd_ps(o, dv, _mm256_loadu_ps(m + i)) : _mm256_setzero_ps();
+                _mm256_storeu_ps(m + i, mv);
+                _mm256_storeu_ps(w + i, _mm256_add_ps(_mm256_loadu_ps(w + i), _mm256_add_ps(mv, dv)));
+            }
+            scalar_kernels::momentum_update(w + i, m + i, d + i, omega, count - i);
+        }
+    }
+
+    namespace avx512_kernels
+    {
+        __attribute__((target("avx512f"))) inline Scalar dot(const Scalar* a, const Scalar* b, blt::size_t count)
+        {
+            __m512 acc0 = _mm512_setzero_ps();
+            __m512 acc1 = _mm512_setzero_ps();
+            blt::size_t i = 0;
+            for (; i + 32 <= count; i += 32)
+            {
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+                acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+            }
+            for (; i + 16 <= count; i += 16)
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+            // masked loads take care of the tail without a scalar loop
+            if (i < count)
+            {
+                const auto mask = static_cast<__mmask16>((1u << (count - i)) - 1);
+                acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+            }
+            // reduce through memory, the shuffle based reductions trip -Wuninitialized inside GCC 12's own intrinsic headers
+            alignas(64) float lanes[16];
+            _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+            Scalar sum = 0;
+            for (auto lane : lanes)
+                sum += lane;
+            return sum;
+        }
+
+        __attribute__((target("avx512f"))) inline void scale(Scalar* out, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            const __m512 a = _mm512_set1_ps(alpha);
+            blt::size_t i = 0;
+            for (; i + 16 <= count; i += 16)
+                _mm512_storeu_ps(out + i, _mm512_mul_ps(a, _mm512_loadu_ps(x + i)));
+            if (i < count)
+            {
+                const auto mask = static_cast<__mmask16>((1u << (count - i)) - 1);
+                _mm512_mask_storeu_ps(out + i, mask, _mm512_mul_ps(a, _mm512_maskz_loadu_ps(mask, x + i)));
+            }
+        }
+
+        __attribute__((target("avx512f"))) inline void axpy(Scalar* y, const Scalar* x, Scalar alpha, blt::size_t count)
+        {
+            const __m512 a = _mm512_set1_ps(alpha);
+            blt::size_t i = 0;
+            for (; i + 16 <= count; i += 16)
+                _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+            if (i < count)
+            {
+                const auto mask = static_cast<__mmask16>((1u << (count - i)) - 1);
+                _mm512_mask_storeu_ps(y + i, mask, _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i)));
+            }
+        }
+
+        __attribute__((target("avx512f"))) inline void momentum_update(Scalar* w, Scalar* m, const Scalar* d, Scalar omega, blt::size_t count)
+        {
+            const __m512 o = _mm512_set1_ps(omega);
+            const bool use_momentum = omega != 0;
+            blt::size_t i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                const __m512 dv = _mm512_loadu_ps(d + i);
+                const __m512 mv = use_momentum ? _mm512_fmadd_ps(o, dv, _mm512_loadu_ps(m + i)) : _mm512_setzero_ps();
+                _mm512_storeu_ps(m + i, mv);
+                _mm512_storeu_ps(w + i, _mm512_add_ps(_mm512_loadu_ps(w + i), _mm512_add_ps(mv, dv)));
+            }
+            scalar_kernels::momentum_update(w + i, m + i, d + i, omega, count - i);
+        }
+    }
+
+
+    namespace int8_avx2_kernels
+    {
+        __attribute__((target("avx2"))) inline std::int32_t horizontal_sum(__m256i v)
+        {
+            __m128i half = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+            half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+            return _mm_cvtsi128_si32(half);
+        }
+
+        __attribute__((target("avx2"))) inline std::int32_t dot_u8s8(const std::uint8_t* a, const std::int8_t* b, blt::size_t count)
+        {
+            const __m256i ones = _mm256_set1_epi16(1);
+            __m256i acc = _mm256_setzero_si256();
+            blt::size_t i = 0;
+            for (; i + 32 <= count; i += 32)
+            {
+                // u8 * s8 products summed in pairs to 16 bits, then in pairs again to 32 bits
+                const __m256i pairs = _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                                           _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+            }
+            return horizontal_sum(acc) + scalar_kernels::dot_u8s8(a + i, b + i, count - i);
+        }
+    }
+
+    namespace int8_avxvnni_kernels
+    {
+        __attribute__((target("avx2,avxvnni"))) inline std::int32_t dot_u8s8(const std::uint8_t* a, const std::int8_t* b, blt::size_t count)
+        {
+            __m256i acc = _mm256_setzero_si256();
+            blt::size_t i = 0;
+            for (; i + 32 <= count; i += 32)
+                acc = _mm256_dpbusd_avx_epi32(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                              _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+            return int8_avx2_kernels::horizontal_sum(acc) + scalar_kernels::dot_u8s8(a + i, b + i, count - i);
+        }
+    }
+
+    namespace int8_avx512vnni_kernels
+    {
+        __attribute__((target("avx512f,avx512bw,avx512vnni"))) inline std::int32_t dot_u8s8(const std::uint8_t* a, const std::int8_t* b,
+                                                                                            blt::size_t count)
+        {
+            __m512i acc = _mm512_setzero_si512();
+            blt::size_t i = 0;
+            for (; i + 64 <= count; i += 64)
+                acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            // _mm512_reduce_add_epi32 trips -Wuninitialized inside GCC's own headers
+            alignas(64) std::int32_t lanes[16];
+            _mm512_store_si512(lanes, acc);
+            std::int32_t sum = 0;
+            for (auto lane : lanes)
+                sum += lane;
+            return sum + scalar_kernels::dot_u8s8(a + i, b + i, count - i);
+        }
+    }
+
+    namespace half_avx2_kernels
+    {
+        __attribute__((target("avx2,fma"))) inline Scalar horizontal_sum(__m256 v)
+        {
+            __m128 half = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+            half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 0x55));
+            return _mm_cvtss_f32(half);
+        }
+
+        __attribute__((target("avx2,fma,f16c"))) inline Scalar dot_fp16(const Eigen::half* w, const Scalar* x, blt::size_t count)
+        {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            blt::size_t i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                const __m256i halves = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i));
+                acc0 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm256_castsi256_si128(halves)), _mm256_loadu_ps(x + i), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm256_extracti128_si256(halves, 1)), _mm256_loadu_ps(x + i + 8), acc1);
+            }
+            return horizontal_sum(_mm256_add_ps(acc0, acc1)) + scalar_kernels::dot_half(w + i, x + i, count - i);
+        }
+
+        __attribute__((target("avx2,fma"))) inline Scalar dot_bf16(const Eigen::bfloat16* w, const Scalar* x, blt::size_t count)
+        {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            blt::size_t i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                // a bfloat16 is the top half of a float, so widening and shifting it up is the conversion
+                const __m256i halves = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i));
+                const __m256 low = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(halves)), 16));
+                const __m256 high = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(halves, 1)), 16));
+                acc0 = _mm256_fmadd_ps(low, _mm256_loadu_ps(x + i), acc0);
+                acc1 = _mm256_fmadd_ps(high, _mm256_loadu_ps(x + i + 8), acc1);
+            }
+            return horizontal_sum(_mm256_add_ps(acc0, acc1)) + scalar_kernels::dot_half(w + i, x + i, count - i);
+        }
+    }
+#endif
+
+    inline kernels_t select_kernels()
+    {
+#ifdef ASSIGN2_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return {"avx512", avx512_kernels::dot, avx512_kernels::scale, avx512_kernels::axpy, avx512_kernels::momentum_update};
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return {"avx2", avx2_kernels::dot, avx2_kernels::scale, avx2_kernels::axpy, avx2_kernels::momentum_update};
+        if (__builtin_cpu_supports("sse2"))
+            return {"sse2", sse2_kernels::dot, sse2_kernels::scale, sse2_kernels::axpy, sse2_kernels::momentum_update};
+#endif
+        return {"scalar", scalar_kernels::dot, scalar_kernels::scale, scalar_kernels::axpy, scalar_kernels::momentum_update};
+    }
+
+    /**
+     * @return the kernels for this CPU, selected the first time this is called
+     */
+    inline const kernels_t& kernels()
+    {
+        static const kernels_t selected = select_kernels();
+        return selected;
+    }
+
+    inline int8_kernels_t select_int8_kernels()
+    {
+#ifdef ASSIGN2_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+            return {"avx512vnni", int8_avx512vnni_kernels::dot_u8s8};
+        if (__builtin_cpu_supports("avxvnni"))
+            return {"avxvnni", int8_avxvnni_kernels::dot_u8s8};
+        if (__builtin_cpu_supports("avx2"))
+            return {"avx2", int8_avx2_kernels::dot_u8s8};
+#endif
+        return {"scalar", scalar_kernels::dot_u8s8};
+    }
+
+    /**
+     * @return the integer kernels for this CPU, selected the first time this is called
+     */
+    inline const int8_kernels_t& int8_kernels()
+    {
+        static const int8_kernels_t selected = select_int8_kernels();
+        return selected;
+    }
+
+    inline half_kernels_t select_half_kernels()
+    {
+#ifdef ASSIGN2_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"))
+            return {"avx2", half_avx2_kernels::dot_fp16, half_avx2_kernels::dot_bf16};
+#endif
+        return {"scalar", scalar_kernels::dot_half<Eigen::half>, scalar_kernels::dot_half<Eigen::bfloat16>};
+    }
+
+    /**
+     * @return the half precision kernels for this CPU, selected the first time this is called
+     */
+    inline const half_kernels_t& half_kernels()
+    {
+        static const half_kernels_t selected = select_half_kernels();
+        return selected;
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_KERNELS_H
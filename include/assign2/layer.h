@@ -23,97 +23,61 @@
     
     #include <blt/std/types.h>
     #include <assign2/initializers.h>
+    #include <assign2/kernels.h>
+    #include <assign2/functions.h>
     #include "blt/iterator/zip.h"
     #include "blt/iterator/iterator.h"
     #include "global_magic.h"
 
 namespace assign2
 {
+    /**
+     * Lightweight view of a single neuron inside a layer_t. The layer owns all of the state in contiguous arrays,
+     * this only exists so code which thinks in terms of neurons can still reach into the layer.
+     */
     class neuron_t
     {
             friend layer_t;
         public:
-            // empty neuron for loading from a stream
-//            explicit neuron_t(weight_view weights, weight_view dw): dw(dw), weights(weights)
-//            {}
-            
-            // neuron with bias
-            explicit neuron_t(weight_view weights, weight_view dw, weight_view momentum, Scalar bias):
-                    bias(bias), dw(dw), weights(weights), momentum(momentum)
+            neuron_t(weight_view weights, weight_view dw, weight_view momentum, Scalar& z, Scalar& a, Scalar& bias, Scalar& db, Scalar& error):
+                    z(z), a(a), bias(bias), db(db), error(error), dw(dw), weights(weights), momentum(momentum)
             {}
             
-            Scalar activate(const std::vector<Scalar>& inputs, function_t* act_func)
+            Scalar activate(span<const Scalar> inputs, function_t* act_func)
             {
                 BLT_ASSERT_MSG(inputs.size() == weights.size(), (std::to_string(inputs.size()) + " vs " + std::to_string(weights.size())).c_str());
                 
-                z = bias;
-                for (auto [x, w] : blt::zip_iterator_container({inputs.begin(), inputs.end()}, {weights.begin(), weights.end()}))
-                    z += x * w;
+                z = bias + kernels().dot(inputs.data(), weights.data(), inputs.size());
                 a = act_func->call(z);
                 return a;
             }
             
-            void back_prop(function_t* act, const std::vector<Scalar>& previous_outputs, Scalar next_error)
+            void back_prop(function_t* act, span<const Scalar> previous_outputs, Scalar next_error)
             {
                 // delta for weights
                 error = act->derivative(z) * next_error;
                 db = -learn_rate * error;
                 BLT_ASSERT(previous_outputs.size() == dw.size());
-                for (auto [prev_out, d_weight] : blt::zip(previous_outputs, dw))
-                {
-                    // dw
-                    d_weight = learn_rate * prev_out * error;
-                }
+                kernels().scale(dw.data(), previous_outputs.data(), learn_rate * error, dw.size());
             }
             
-            void update(float omega, bool reset)
+            void update(float omega, bool)
             {
-                // if omega is zero we are not using momentum.
-                if (omega == 0)
-                {
-//                    BLT_TRACE("Momentum Reset");
-//                    for (auto& v : momentum)
-//                        std::cout << v << ',';
-//                    std::cout << std::endl;
-                    for (auto& m : momentum)
-                        m = 0;
-                } else
-                {
-                    for (auto [m, d] : blt::in_pairs(momentum, dw))
-                        m += omega * d;
-                }
-                for (auto [w, m, d] : blt::zip(weights, momentum, dw))
-                    w += m + d;
+                kernels().momentum_update(weights.data(), momentum.data(), dw.data(), omega, weights.size());
                 bias += db;
             }
             
-            template<typename OStream>
-            OStream& serialize(OStream& stream)
-            {
-                stream << bias;
-                for (auto d : weights)
-                    stream << d;
-            }
-            
-            template<typename IStream>
-            IStream& deserialize(IStream& stream)
-            {
-                for (auto& d : blt::iterate(weights).rev())
-                    stream >> d;
-                stream >> bias;
-            }
-            
             void debug() const
             {
                 std::cout << bias << " ";
             }
         
         private:
-            float z = 0;
-            float a = 0;
-            float bias = 0;
-            float db = 0;
-            float error = 0;
+            Scalar& z;
+            Scalar& a;
+            Scalar& bias;
+            Scalar& db;
+            Scalar& error;
             weight_view dw;
             weight_view weights;
             weight_view momentum;
@@ -123,47 +87,59 @@ namespace assign2
     {
             friend network_t;
         public:
+            /**
+             * @param activation either one of the known activation functions by value, which lets the forward and backward passes
+             * be compiled against the concrete type, or a function_t* for anything only known at runtime.
+             */
             template<typename WeightFunc, typename BiasFunc>
-            layer_t(const blt::i32 in, const blt::i32 out, function_t* act_func, WeightFunc w, BiasFunc b):
-                    in_size(in), out_size(out), layer_id(layer_id_counter++), act_func(act_func)
+            layer_t(const blt::i32 in, const blt::i32 out, activation_t activation, WeightFunc w, BiasFunc b): layer_t(in, out, activation)
             {
-                neurons.reserve(out_size);
-                weights.preallocate(in_size * out_size);
-                weight_derivatives.preallocate(in_size * out_size);
-                momentum.preallocate(in_size * out_size);
+                // the arena holds the out_size x in_size row-major weight matrix followed by the biases
+                weights.preallocate(matrix_size() + out_size);
+                weight_matrix = weights.allocate_view(matrix_size());
+                bias = weights.allocate_view(out_size);
+                
                 for (blt::i32 i = 0; i < out_size; i++)
                 {
-                    auto weight = weights.allocate_view(in_size);
-                    auto dw = weight_derivatives.allocate_view(in_size);
-                    auto m = momentum.allocate_view(in_size);
-                    for (auto& v : weight)
+                    for (auto& v : row(weight_matrix, i))
                         v = w(i);
-                    neurons.push_back(neuron_t{weight, dw, m, b(i)});
+                    bias[i] = b(i);
                 }
             }
             
-            const std::vector<Scalar>& call(const std::vector<Scalar>& in)
+            /**
+             * makes a layer which uses params as its weights and biases instead of its own arena, laid out the same way (see parameters()).
+             * params must outlive the layer
+             */
+            layer_t(const blt::i32 in, const blt::i32 out, activation_t activation, weight_view params): layer_t(in, out, activation)
+            {
+                BLT_ASSERT(params.size() == matrix_size() + out_size);
+                weight_matrix = params.sub_view(0, matrix_size());
+                bias = params.sub_view(matrix_size(), out_size);
+            }
+            
+            const std::vector<Scalar>& call(span<const Scalar> in)
             {
-                outputs.clear();
-                outputs.reserve(out_size);
 #if BLT_DEBUG_LEVEL > 0
                 if (in.size() != in_size)
                     throw std::runtime_exception("Input vector doesn't match expected input size!");
 #endif
-                for (auto& n : neurons)
-                    outputs.push_back(n.activate(in, act_func));
+                const auto& k = kernels();
+                for (blt::i32 i = 0; i < out_size; i++)
+                    z[i] = bias[i] + k.dot(in.data(), row(weight_matrix, i).data(), in_size);
+                visit_activation([this](const auto& act) { act.apply(z, outputs); });
                 return outputs;
             }
             
-            error_data_t back_prop(const std::vector<Scalar>& prev_layer_output,
+            error_data_t back_prop(span<const Scalar> prev_layer_output,
                                    const std::variant<blt::ref<const std::vector<Scalar>>, blt::ref<const layer_t>>& data)
             {
                 Scalar total_error = 0;
                 Scalar total_derivative = 0;
                 std::visit(blt::lambda_visitor{
                         // is provided if we are an output layer, contains output of this net (per neuron) and the expected output (per neuron)
-                        [this, &prev_layer_output, &total_error, &total_derivative](const std::vector<Scalar>& expected) {
-                            for (auto [i, n] : blt::enumerate(neurons))
+                        [this, &total_error, &total_derivative](const std::vector<Scalar>& expected) {
+                            for (blt::i32 i = 0; i < out_size; i++)
                             {
                                 auto d = expected[i] - outputs[i];
 //                                if (outputs[0] > 0.3 && outputs[1] > 0.3)
@@ -174,42 +150,173 @@ namespace assign2
                                 // and that the total cost for an input pattern is the sum of costs on the output
                                 total_error += d2;
                                 total_derivative += d;
-                                n.back_prop(act_func, prev_layer_output, d);
+                                errors[i] = d;
                             }
                         },
                         // interior layer
-                        [this, &prev_layer_output](const layer_t& layer) {
-                            for (auto [i, n] : blt::enumerate(neurons))
-                            {
-                                // TODO: this is not efficient on the cache!
-                                Scalar w = 0;
-                                for (auto nn : layer.neurons)
-                                    w += nn.error * nn.weights[i];
-                                n.back_prop(act_func, prev_layer_output, w);
-                            }
+                        [this](const layer_t& layer) {
+                            BLT_ASSERT(layer.in_size == out_size);
+                            // W^T * delta of the next layer. accumulating whole rows scaled by each delta reads the next layer's
+                            // weights in memory order, walking down a column per neuron would touch every row once per neuron
+                            std::fill(errors.begin(), errors.end(), 0);
+                            const auto& k = kernels();
+                            for (blt::i32 j = 0; j < layer.out_size; j++)
+                                k.axpy(errors.data(), layer.row(layer.weight_matrix, j).data(), layer.errors[j], out_size);
                         }
                 }, data);
+                
+                // errors currently holds the error flowing into each neuron, scale it by the derivative to get the delta
+                visit_activation([this](const auto& act) { act.derivative(z, derivatives); });
+                const auto& k = kernels();
+                BLT_ASSERT(prev_layer_output.size() == static_cast<blt::size_t>(in_size));
+                for (blt::i32 i = 0; i < out_size; i++)
+                {
+                    const auto error = errors[i] * derivatives[i];
+                    errors[i] = error;
+                    db[i] = -learn_rate * error;
+                    k.scale(row(dw_matrix, i).data(), prev_layer_output.data(), learn_rate * error, in_size);
+                }
                 return {total_error, total_derivative};
             }
             
-            void update(const float* omega, bool reset)
+            /**
+             * sizes the batch state for batches of up to columns samples. it only ever grows, so after this batches of that size
+             * or smaller don't allocate
+             */
+            void reserve_batch(Eigen::Index columns)
             {
-                for (auto& n : neurons)
-                    n.update(omega == nullptr ? 0 : *omega, reset);
+                if (batch_z.cols() >= columns)
+                    return;
+                for (auto* m : {&batch_z, &batch_outputs, &batch_errors, &batch_derivatives})
+                    m->resize(out_size, columns);
             }
             
-            template<typename OStream>
-            OStream& serialize(OStream& stream)
+            /**
+             * forward pass over a whole batch at once, each column of in is a sample.
+             * the outputs are kept on the layer so back_prop_batch can use them.
+             */
+            matrix_view_t call_batch(const matrix_view_t& in)
             {
-                for (auto d : neurons)
-                    stream << d;
+                BLT_ASSERT(in.rows() == in_size);
+                reserve_batch(in.cols());
+                batch_count = in.cols();
+                auto z_block = batch_z.leftCols(batch_count);
+                z_block.noalias() = as_matrix(weight_matrix) * in;
+                z_block.colwise() += as_vector(bias);
+                visit_activation([this](const auto& act) { act.apply(batch_span(batch_z), batch_span(batch_outputs)); });
+                return batch_outputs_view();
             }
             
-            template<typename IStream>
-            IStream& deserialize(IStream& stream)
+            /**
+             * @return the outputs of the batch last passed to call_batch
+             */
+            [[nodiscard]] matrix_view_t batch_outputs_view() const
             {
-                for (auto& d : blt::iterate(neurons).rev())
-                    stream >> d;
+                return batch_outputs.leftCols(batch_count);
+            }
+            
+            /**
+             * back prop over the batch last passed to call_batch. gradients are summed over the batch and multiplied by scale,
+             * so passing learn_rate / batch_size gives the averaged update which is applied by update()
+             */
+            error_data_t back_prop_batch(const matrix_view_t& prev_layer_output,
+                                         const std::variant<matrix_view_t, blt::ref<const layer_t>>& data, Scalar scale)
+            {
+                BLT_ASSERT(prev_layer_output.cols() == batch_count);
+                Scalar total_error = 0;
+                Scalar total_derivative = 0;
+                auto errors_block = batch_errors.leftCols(batch_count);
+                std::visit(blt::lambda_visitor{
+                        // output layer, the expected matrix has the same shape as our outputs
+                        [&](const matrix_view_t& expected) {
+                            errors_block = expected - batch_outputs.leftCols(batch_count);
+                            total_error = 0.5f * errors_block.squaredNorm();
+                            total_derivative = errors_block.sum();
+                        },
+                        // interior layer, W^T * delta of the next layer
+                        [&](const layer_t& layer) {
+                            errors_block.noalias() = layer.as_matrix(layer.weight_matrix).transpose() * layer.batch_errors.leftCols(batch_count);
+                        }
+                }, data);
+                visit_activation([this](const auto& act) { act.derivative(batch_span(batch_z), batch_span(batch_derivatives)); });
+                errors_block.array() *= batch_derivatives.leftCols(batch_count).array();
+                
+                as_matrix(dw_matrix).noalias() = scale * errors_block * prev_layer_output.transpose();
+                as_vector(db) = -scale * errors_block.rowwise().sum();
+                return {total_error, total_derivative};
+            }
+            
+            void update(const float* omega, bool)
+            {
+                // the matrices are contiguous so there is no reason to walk them per neuron
+                const auto& k = kernels();
+                k.momentum_update(weight_matrix.data(), momentum_matrix.data(), dw_matrix.data(), omega == nullptr ? 0 : *omega,
+                                  weight_matrix.size());
+                k.axpy(bias.data(), db.data(), 1, bias.size());
+            }
+            
+            [[nodiscard]] neuron_t neuron(blt::i32 i)
+            {
+                return neuron_t{row(weight_matrix, i), row(dw_matrix, i), row(momentum_matrix, i), z[i], outputs[i], bias[i], db[i], errors[i]};
+            }
+            
+            /**
+             * @return the weight matrix followed by the biases, which are always next to each other in memory
+             */
+            [[nodiscard]] weight_view parameters() const
+            {
+                return {weight_matrix.data(), weight_matrix.size() + bias.size()};
+            }
+            
+            /**
+             * @return the weight matrix gradients followed by the bias gradients, laid out the same as parameters()
+             */
+            [[nodiscard]] weight_view gradients() const
+            {
+                return {dw_matrix.data(), dw_matrix.size() + db.size()};
+            }
+            
+            /**
+             * @return the momentum carried between updates of the weight matrix, the biases have none
+             */
+            [[nodiscard]] weight_view momentum_values() const
+            {
+                return momentum_matrix;
+            }
+            
+            /**
+             * makes this layer use the weights and biases of owner, which must be the same shape and outlive us.
+             * the activations, gradients and momentum are still our own so both layers can train at the same time.
+             */
+            void share_weights(const layer_t& owner)
+            {
+                BLT_ASSERT(owner.in_size == in_size && owner.out_size == out_size);
+                weights = {};
+                weight_matrix = owner.weight_matrix;
+                bias = owner.bias;
+            }
+            
+            /**
+             * @return a new layer of the same shape and activation holding a copy of our weights and biases
+             */
+            [[nodiscard]] std::unique_ptr<layer_t> clone() const
+            {
+                auto layer = std::make_unique<layer_t>(in_size, out_size, activation, empty_init{}, empty_init{});
+                std::copy(parameters().begin(), parameters().end(), layer->parameters().begin());
+                return layer;
+            }
+            
+            /**
+             * @return what the layer output for the last input passed to call()
+             */
+            [[nodiscard]] const std::vector<Scalar>& get_outputs() const
+            {
+                return outputs;
+            }
+            
+            [[nodiscard]] const activation_t& get_activation() const
+            {
+                return activation;
             }
             
             [[nodiscard]] inline blt::i32 get_in_size() const
@@ -225,12 +332,12 @@ namespace assign2
             void debug() const
             {
                 std::cout << "Bias: ";
-                for (auto& v : neurons)
-                    v.debug();
+                for (auto v : bias)
+                    std::cout << v << " ";
                 std::cout << std::endl;
                 weights.debug();
             }
-
+            
 #ifdef BLT_USE_GRAPHICS
             
             void render(blt::gfx::batch_renderer_2d& renderer) const
@@ -238,9 +345,9 @@ namespace assign2
                 const blt::size_t distance_between_layers = 30;
                 const float neuron_size = 30;
                 const float padding = -5;
-                for (const auto& [i, n] : blt::enumerate(neurons))
+                for (const auto& [i, a] : blt::enumerate(outputs))
                 {
-                    auto color = std::abs(n.a);
+                    auto color = std::abs(a);
                     renderer.drawPointInternal(blt::make_color(0.1, 0.1, 0.1),
                                                blt::gfx::point2d_t{static_cast<float>(i) * (neuron_size + padding) + neuron_size,
                                                                    static_cast<float>(layer_id * distance_between_layers) + neuron_size,
@@ -260,18 +367,96 @@ namespace assign2
 //                    ImGui::PopStyleVar();
                 }
             }
-
+            
 #endif
         
         private:
+            /**
+             * sets up everything but the weights and biases
+             */
+            layer_t(const blt::i32 in, const blt::i32 out, activation_t activation):
+                    in_size(in), out_size(out), layer_id(layer_id_counter++), activation(activation)
+            {
+                // the derivative arena mirrors the weight arena, dw matrix followed by db
+                weight_derivatives.preallocate(matrix_size() + out_size);
+                momentum.preallocate(matrix_size());
+                dw_matrix = weight_derivatives.allocate_view(matrix_size());
+                db = weight_derivatives.allocate_view(out_size);
+                momentum_matrix = momentum.allocate_view(matrix_size());
+                
+                z.resize(out_size);
+                outputs.resize(out_size);
+                errors.resize(out_size);
+                derivatives.resize(out_size);
+            }
+            
+            [[nodiscard]] blt::size_t matrix_size() const
+            {
+                return static_cast<blt::size_t>(in_size) * static_cast<blt::size_t>(out_size);
+            }
+            
+            using matrix_map_t = Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>;
+            using vector_map_t = Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>;
+            
+            [[nodiscard]] inline matrix_map_t as_matrix(const weight_view& matrix) const
+            {
+                return {matrix.data(), out_size, in_size};
+            }
+            
+            [[nodiscard]] inline static vector_map_t as_vector(const weight_view& vector)
+            {
+                return {vector.data(), static_cast<Eigen::Index>(vector.size())};
+            }
+            
+            /**
+             * calls func with the activation as its concrete type when we know it, otherwise as a function_t&
+             */
+            template<typename Func>
+            void visit_activation(Func&& func) const
+            {
+                assign2::visit_activation(activation, std::forward<Func>(func));
+            }
+            
+            /**
+             * @return the columns of matrix used by the current batch, which are contiguous since matrix_t is column-major
+             */
+            [[nodiscard]] inline span<Scalar> batch_span(matrix_t& matrix) const
+            {
+                return {matrix.data(), static_cast<blt::size_t>(matrix.rows() * batch_count)};
+            }
+            
+            [[nodiscard]] inline weight_view row(const weight_view& matrix, blt::i32 i) const
+            {
+                return matrix.sub_view(static_cast<blt::size_t>(i) * in_size, in_size);
+            }
+            
             const blt::i32 in_size, out_size;
             const blt::size_t layer_id;
+            // weight matrix followed by biases
             weight_t weights;
+            // dw matrix followed by db
             weight_t weight_derivatives;
             weight_t momentum;
-            function_t* act_func;
-            std::vector<neuron_t> neurons;
+            activation_t activation;
+            // views into the arenas above, the matrices are out_size x in_size and row-major
+            weight_view weight_matrix;
+            weight_view bias;
+            weight_view dw_matrix;
+            weight_view db;
+            weight_view momentum_matrix;
+            // per neuron state, stored as separate arrays so the hot loops stay contiguous
+            std::vector<Scalar> z;
             std::vector<Scalar> outputs;
+            std::vector<Scalar> errors;
+            // scratch for the activation derivatives during back prop
+            std::vector<Scalar> derivatives;
+            // state of the last batch, out_size x batch
+            matrix_t batch_z;
+            matrix_t batch_outputs;
+            matrix_t batch_errors;
+            matrix_t batch_derivatives;
+            // samples in the last batch, the leading columns of the matrices above
+            Eigen::Index batch_count = 0;
     };
 }
 
@@ -0,0 +1,126 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_METRICS_H
+#define COSC_4P80_ASSIGNMENT_2_METRICS_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * the per epoch series the GUI plots, owned per run so several networks can train at once without sharing the globals
+     * in global_magic.h. columns match save_error_info()
+     */
+    struct training_metrics_t
+    {
+        std::vector<Scalar> train_error;
+        std::vector<Scalar> train_d_error;
+        std::vector<Scalar> test_error;
+        std::vector<Scalar> test_d_error;
+        std::vector<Scalar> correct_train;
+        std::vector<Scalar> correct_test;
+        
+        void reserve(blt::size_t epochs)
+        {
+            for (auto* series : {&train_error, &train_d_error, &test_error, &test_d_error, &correct_train, &correct_test})
+                series->reserve(epochs);
+        }
+        
+        [[nodiscard]] blt::size_t epochs() const
+        {
+            return train_error.size();
+        }
+        
+        void save(const std::string& name) const
+        {
+            save_as_csv("network" + name + ".csv", {{"train_error",   train_error},
+                                                    {"train_d_error", train_d_error},
+                                                    {"test_error",    test_error},
+                                                    {"test_d_error",  test_d_error},
+                                                    {"correct_train", correct_train},
+                                                    {"correct_test",  correct_test}});
+        }
+        
+        /**
+         * @return the element-wise mean of every series over all runs, cut to the shortest run
+         */
+        static training_metrics_t mean(const std::vector<training_metrics_t>& runs)
+        {
+            training_metrics_t result;
+            if (runs.empty())
+                return result;
+            blt::size_t epochs = runs.front().epochs();
+            for (const auto& run : runs)
+                epochs = std::min(epochs, run.epochs());
+            
+            auto average = [&runs, epochs](std::vector<Scalar> training_metrics_t::* series) {
+                std::vector<Scalar> out(epochs, 0);
+                for (const auto& run : runs)
+                    for (blt::size_t i = 0; i < epochs; i++)
+                        out[i] += (run.*series)[i];
+                for (auto& v : out)
+                    v /= static_cast<Scalar>(runs.size());
+                return out;
+            };
+            result.train_error = average(&training_metrics_t::train_error);
+            result.train_d_error = average(&training_metrics_t::train_d_error);
+            result.test_error = average(&training_metrics_t::test_error);
+            result.test_d_error = average(&training_metrics_t::test_d_error);
+            result.correct_train = average(&training_metrics_t::correct_train);
+            result.correct_test = average(&training_metrics_t::correct_test);
+            return result;
+        }
+    };
+    
+    /**
+     * records the same statistics the GUI collects after each epoch
+     * @param error what training the epoch returned
+     */
+    inline void evaluate(network_t& network, error_data_t error, const data_file_t& training, const data_file_t& testing,
+                         training_metrics_t& metrics)
+    {
+        metrics.train_error.push_back(error.error);
+        metrics.train_d_error.push_back(error.d_error);
+        
+        ASSIGN2_PROFILE_SCOPE("evaluate");
+        auto error_test = network.error(testing);
+        metrics.test_error.push_back(error_test.error);
+        metrics.test_d_error.push_back(error_test.d_error);
+        
+        metrics.correct_train.push_back(network.percent_correct(training));
+        metrics.correct_test.push_back(network.percent_correct(testing));
+    }
+    
+    /**
+     * trains the network for one epoch then records the same statistics the GUI collects after each epoch
+     * @param batch_size if set train with mini-batches of this size instead of per-sample SGD
+     */
+    inline void train_and_evaluate(network_t& network, const data_file_t& training, const data_file_t& testing, training_metrics_t& metrics,
+                                   std::optional<blt::size_t> batch_size = {})
+    {
+        auto error = batch_size ? network.train_batch(training.data_points, *batch_size) : network.train_epoch(training);
+        evaluate(network, error, training, testing, metrics);
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_METRICS_H
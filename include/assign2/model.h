@@ -0,0 +1,185 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_MODEL_H
+#define COSC_4P80_ASSIGNMENT_2_MODEL_H
+
+#include <assign2/common.h>
+#include <assign2/functions.h>
+#include <assign2/layer.h>
+#include <assign2/network.h>
+#include <assign2/dataset.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace assign2
+{
+    /*
+     * model files, in native byte order:
+     *  header          model_header_t
+     *  layers          layer_count model_layer_t, input layer first
+     *  parameters      each layer's parameters() (the row-major out x in weight matrix then the biases) starting on a 64 byte
+     *                  boundary, exactly as they sit in the layer's weight arena
+     * loading maps the file and points the layers straight at the parameters in the mapping, so every process using the same
+     * model shares the same pages until one of them trains and gets its own copy of the pages it writes.
+     */
+    
+    struct model_header_t
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t scalar_size;
+        std::uint64_t layer_count;
+    };
+    
+    struct model_layer_t
+    {
+        std::int32_t in_size;
+        std::int32_t out_size;
+        // see activation_id()
+        std::uint32_t activation;
+        std::uint32_t reserved;
+        std::uint64_t parameters_offset;
+        std::uint64_t parameter_count;
+    };
+    
+    inline constexpr char model_magic[8] = {'A', '2', 'M', 'O', 'D', 'E', 'L', '\0'};
+    inline constexpr std::uint32_t model_version = 1;
+    inline constexpr blt::size_t model_alignment = 64;
+    
+    /**
+     * writes the network to path, going through a temporary file that is synced before being renamed into place so a reader never
+     * sees half a model, even after a crash
+     */
+    inline void save_model(const network_t& network, const std::string& path)
+    {
+        model_header_t header{};
+        std::memcpy(header.magic, model_magic, sizeof(header.magic));
+        header.version = model_version;
+        header.scalar_size = sizeof(Scalar);
+        header.layer_count = network.layer_count();
+        
+        std::vector<model_layer_t> layers;
+        auto offset = static_cast<blt::size_t>(sizeof(model_header_t) + sizeof(model_layer_t) * network.layer_count());
+        for (blt::size_t i = 0; i < network.layer_count(); i++)
+        {
+            const auto& layer = network.layer(i);
+            model_layer_t entry{};
+            entry.in_size = layer.get_in_size();
+            entry.out_size = layer.get_out_size();
+            entry.activation = activation_id(layer.get_activation());
+            if (entry.activation == 0)
+                throw std::runtime_error("Only the built in activation functions can be saved");
+            offset = (offset + model_alignment - 1) / model_alignment * model_alignment;
+            entry.parameters_offset = offset;
+            entry.parameter_count = layer.parameters().size();
+            offset += entry.parameter_count * sizeof(Scalar);
+            layers.push_back(entry);
+        }
+        
+        // a unique name so processes saving the same model at once don't write over each other's temporary file
+        auto temp_path = path + ".XXXXXX";
+        auto fd = ::mkstemp(temp_path.data());
+        if (fd < 0)
+            throw std::runtime_error("Unable to write model '" + path + "'");
+        // mkstemp only lets the owner read it, a model is meant to be loaded by other processes
+        ::fchmod(fd, 0644);
+        auto file = ::fdopen(fd, "wb");
+        if (file == nullptr)
+        {
+            ::close(fd);
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Unable to write model '" + path + "'");
+        }
+        
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && std::fwrite(layers.data(), sizeof(model_layer_t), layers.size(), file) == layers.size();
+        auto position = static_cast<blt::size_t>(sizeof(model_header_t) + sizeof(model_layer_t) * layers.size());
+        const char padding[model_alignment] = {};
+        for (auto [i, entry] : blt::enumerate(layers))
+        {
+            const auto padding_bytes = entry.parameters_offset - position;
+            ok = ok && std::fwrite(padding, 1, padding_bytes, file) == padding_bytes;
+            const auto params = network.layer(i).parameters();
+            ok = ok && std::fwrite(params.data(), sizeof(Scalar), params.size(), file) == params.size();
+            position = entry.parameters_offset + params.size() * sizeof(Scalar);
+        }
+        // synced before the rename so a crash can't leave a model in place whose contents never made it to disk
+        ok = ok && std::fflush(file) == 0 && ::fsync(::fileno(file)) == 0;
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Unable to write model '" + path + "'");
+        }
+    }
+    
+    /**
+     * maps a model written by save_model(), the returned network's weights and biases are the mapped file
+     */
+    inline network_t load_model(const std::string& path)
+    {
+        auto mapping = mapped_file_t::open(path, true);
+        if (mapping == nullptr)
+            throw std::runtime_error("Unable to open model '" + path + "'");
+        if (mapping->size() < sizeof(model_header_t))
+            throw std::runtime_error("Model '" + path + "' is truncated");
+        
+        model_header_t header{};
+        std::memcpy(&header, mapping->data(), sizeof(header));
+        if (std::memcmp(header.magic, model_magic, sizeof(header.magic)) != 0)
+            throw std::runtime_error("'" + path + "' is not a model");
+        if (header.version != model_version || header.scalar_size != sizeof(Scalar))
+            throw std::runtime_error("Model '" + path + "' was written by an incompatible version");
+        // the counts and offsets come from the file, so the checks are written so that they can't overflow
+        if (header.layer_count == 0 || header.layer_count > (mapping->size() - sizeof(model_header_t)) / sizeof(model_layer_t))
+            throw std::runtime_error("Model '" + path + "' is truncated");
+        
+        std::vector<std::unique_ptr<layer_t>> layers;
+        for (blt::size_t i = 0; i < header.layer_count; i++)
+        {
+            model_layer_t entry{};
+            std::memcpy(&entry, mapping->data() + sizeof(model_header_t) + i * sizeof(model_layer_t), sizeof(entry));
+            auto activation = make_activation(entry.activation);
+            if (!activation)
+                throw std::runtime_error("Model '" + path + "' uses an unknown activation function");
+            const auto expected = static_cast<blt::size_t>(entry.in_size) * static_cast<blt::size_t>(entry.out_size) +
+                                  static_cast<blt::size_t>(entry.out_size);
+            if (entry.in_size <= 0 || entry.out_size <= 0 || entry.parameter_count != expected ||
+                entry.parameters_offset % alignof(Scalar) != 0 || entry.parameters_offset > mapping->size() ||
+                expected > (mapping->size() - entry.parameters_offset) / sizeof(Scalar))
+                throw std::runtime_error("Model '" + path + "' has a corrupt layer");
+            if (!layers.empty() && layers.back()->get_out_size() != entry.in_size)
+                throw std::runtime_error("Model '" + path + "' has layers which don't connect");
+            
+            weight_view params{reinterpret_cast<Scalar*>(mapping->mutable_data() + entry.parameters_offset), expected};
+            layers.push_back(std::make_unique<layer_t>(entry.in_size, entry.out_size, *activation, params));
+        }
+        return network_t{std::move(layers), std::move(mapping)};
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_MODEL_H
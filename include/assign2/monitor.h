@@ -0,0 +1,319 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_MONITOR_H
+#define COSC_4P80_ASSIGNMENT_2_MONITOR_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/features.h>
+#include <assign2/alloc_tracker.h>
+#include <unsupported/Eigen/FFT>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace assign2
+{
+    /**
+     * keeps the latency of the most recent windows, everything is allocated up front
+     */
+    class latency_stats_t
+    {
+        public:
+            explicit latency_stats_t(blt::size_t capacity, double budget_us): samples(capacity), scratch(capacity), budget_us(budget_us)
+            {}
+            
+            /**
+             * @return true if the window was over budget
+             */
+            bool record(double latency_us)
+            {
+                samples[count % samples.size()] = latency_us;
+                count++;
+                if (latency_us <= budget_us)
+                    return false;
+                over_budget++;
+                return true;
+            }
+            
+            /**
+             * @return the p'th percentile (0 - 1) of the windows we still have
+             */
+            double percentile(double p)
+            {
+                const auto size = std::min(count, samples.size());
+                if (size == 0)
+                    return 0;
+                std::copy(samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(size), scratch.begin());
+                const auto nth = std::min(size - 1, static_cast<blt::size_t>(p * static_cast<double>(size)));
+                std::nth_element(scratch.begin(), scratch.begin() + static_cast<std::ptrdiff_t>(nth),
+                                 scratch.begin() + static_cast<std::ptrdiff_t>(size));
+                return scratch[nth];
+            }
+            
+            [[nodiscard]] blt::size_t windows() const
+            {
+                return count;
+            }
+            
+            [[nodiscard]] blt::size_t windows_over_budget() const
+            {
+                return over_budget;
+            }
+            
+            [[nodiscard]] double budget() const
+            {
+                return budget_us;
+            }
+        
+        private:
+            std::vector<double> samples;
+            std::vector<double> scratch;
+            blt::size_t count = 0;
+            blt::size_t over_budget = 0;
+            double budget_us;
+    };
+    
+    /**
+     * online motor monitoring. samples are pushed into a ring buffer holding the last window, every hop samples the window is
+     * turned into bins the same way extract_features() does and run through the network.
+     * after construction nothing on the per sample or per window path touches the heap. the verdicts are printed after each read,
+     * one line per window, "index good|bad latency" with "over budget" on the end of windows that missed the budget.
+     */
+    class stream_monitor_t
+    {
+        public:
+            /**
+             * @param bin_count the input size of network
+             * @param spectrum_bins the resolution the spectrum is computed at before being band summed down to bin_count, this
+             * should be the largest bin count the network's training data was extracted alongside. windows are twice this long
+             * @param hop samples between windows, 0 uses the window size
+             */
+            stream_monitor_t(network_t& network, blt::size_t bin_count, blt::size_t spectrum_bins, blt::size_t hop, double budget_us,
+                             blt::size_t latency_history = 4096):
+                    network(network), bin_count(bin_count), spectrum_bins(std::max(bin_count, spectrum_bins)),
+                    window_size(this->spectrum_bins * 2), hop(hop == 0 ? window_size : hop), ring(window_size), window(window_size),
+                    spectrum(window_size / 2 + 1), fine(this->spectrum_bins), bins(bin_count), stats(latency_history, budget_us)
+            {
+                // every sample in a read takes at least two characters, one for the number and one to separate it from the next
+                pending.reserve(read_buffer_size / 2 + 1);
+                fft.SetFlag(Eigen::FFT<Scalar>::HalfSpectrum);
+                // the fft builds its plan and the network sizes its buffers on first use, get that out of the way now
+                fft.fwd(spectrum.data(), window.data(), static_cast<Eigen::Index>(window_size));
+                network.execute(bins);
+            }
+            
+            /**
+             * adds a sample, running the network if it completes a hop
+             */
+            void push(Scalar sample)
+            {
+                ring[position] = sample;
+                position = (position + 1) % window_size;
+                if (filled < window_size)
+                    filled++;
+                if (filled == window_size && ++since_hop >= hop)
+                {
+                    since_hop = 0;
+                    process_window();
+                }
+            }
+            
+            latency_stats_t& latency()
+            {
+                return stats;
+            }
+            
+            /**
+             * prints the windows processed since the last report. run() calls this after every read, kept out of process_window() so
+             * writing to a slow stdout doesn't hold up the samples behind it
+             */
+            void report()
+            {
+                for (const auto& r : pending)
+                    std::printf("%zu %s %.1fus%s\n", static_cast<std::size_t>(r.index), r.is_bad ? "bad" : "good", r.latency_us,
+                                r.over_budget ? " over budget" : "");
+                pending.clear();
+                std::fflush(stdout);
+            }
+            
+            /**
+             * reads whitespace separated samples from fd until the end of the stream. regular files are followed like tail -f,
+             * waiting for more data to be appended, until stop returns true. pipes, FIFOs and terminals end when the writer closes.
+             * stop is checked at least every 100ms, even while nothing arrives.
+             */
+            template<typename StopFunc>
+            void run(int fd, StopFunc&& stop)
+            {
+                struct stat info{};
+                const bool follow = ::fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+                
+                // a number can be split over two reads, so whatever follows the last separator is moved to the front
+                char buffer[read_buffer_size];
+                blt::size_t kept = 0;
+                while (!stop())
+                {
+                    // a read on a quiet pipe would block until the writer sends more, however long that is
+                    pollfd poll_fd{fd, POLLIN, 0};
+                    auto ready = ::poll(&poll_fd, 1, 100);
+                    if (ready < 0 && errno != EINTR)
+                        throw std::runtime_error(std::string("Failed to wait for samples: ") + std::strerror(errno));
+                    if (ready <= 0)
+                        continue;
+                    auto amount = ::read(fd, buffer + kept, sizeof(buffer) - kept);
+                    if (amount < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        throw std::runtime_error(std::string("Failed to read samples: ") + std::strerror(errno));
+                    }
+                    if (amount == 0)
+                    {
+                        if (!follow)
+                            break;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                        continue;
+                    }
+                    const auto size = kept + static_cast<blt::size_t>(amount);
+                    blt::size_t complete = size;
+                    while (complete > 0 && !is_separator(buffer[complete - 1]))
+                        complete--;
+                    if (complete == 0 && size == sizeof(buffer))
+                        throw std::runtime_error("Sample is longer than the read buffer");
+                    parse(buffer, buffer + complete);
+                    report();
+                    kept = size - complete;
+                    std::memmove(buffer, buffer + complete, kept);
+                }
+                if (kept > 0)
+                    parse(buffer, buffer + kept);
+                report();
+            }
+        
+        private:
+            static constexpr blt::size_t read_buffer_size = 1 << 16;
+            
+            struct window_result_t
+            {
+                blt::size_t index;
+                bool is_bad;
+                bool over_budget;
+                double latency_us;
+            };
+            
+            static bool is_separator(char c)
+            {
+                return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',';
+            }
+            
+            void parse(const char* ptr, const char* end)
+            {
+                while (ptr != end)
+                {
+                    if (is_separator(*ptr))
+                    {
+                        ++ptr;
+                        continue;
+                    }
+                    Scalar v;
+                    auto [value_end, error] = std::from_chars(ptr, end, v);
+                    if (error != std::errc{})
+                    {
+                        // skip whatever this is rather than stop monitoring
+                        while (ptr != end && !is_separator(*ptr))
+                            ++ptr;
+                        continue;
+                    }
+                    ptr = value_end;
+                    push(v);
+                }
+            }
+            
+            void process_window()
+            {
+                const auto start = std::chrono::steady_clock::now();
+                bool is_bad;
+                {
+                    ASSIGN2_ASSERT_NO_ALLOCATIONS("stream_monitor_t::process_window allocated");
+                    // unroll the ring so the window is in order, oldest sample first
+                    std::copy(ring.begin() + static_cast<std::ptrdiff_t>(position), ring.end(), window.begin());
+                    std::copy(ring.begin(), ring.begin() + static_cast<std::ptrdiff_t>(position),
+                              window.begin() + static_cast<std::ptrdiff_t>(window_size - position));
+                    fft.fwd(spectrum.data(), window.data(), static_cast<Eigen::Index>(window_size));
+                    for (blt::size_t b = 0; b < spectrum_bins; b++)
+                        fine[b] = std::abs(spectrum[b]);
+                    band_sum(fine, bins);
+                    is_bad = is_thinks_bad(network.execute(bins));
+                }
+                const auto end = std::chrono::steady_clock::now();
+                const auto latency_us = std::chrono::duration<double, std::micro>(end - start).count();
+                const auto over_budget = stats.record(latency_us);
+                // only reachable past what the constructor reserved if a caller pushes samples without a report in between
+                if (pending.size() == pending.capacity())
+                    report();
+                pending.push_back({stats.windows() - 1, is_bad, over_budget, latency_us});
+            }
+            
+            network_t& network;
+            blt::size_t bin_count;
+            blt::size_t spectrum_bins;
+            blt::size_t window_size;
+            blt::size_t hop;
+            
+            std::vector<Scalar> ring;
+            blt::size_t position = 0;
+            blt::size_t filled = 0;
+            blt::size_t since_hop = 0;
+            
+            Eigen::FFT<Scalar> fft;
+            std::vector<Scalar> window;
+            std::vector<std::complex<Scalar>> spectrum;
+            std::vector<Scalar> fine;
+            std::vector<Scalar> bins;
+            latency_stats_t stats;
+            std::vector<window_result_t> pending;
+    };
+    
+    /**
+     * @return a descriptor to read samples from, "-" being stdin
+     */
+    inline int open_sample_source(const std::string& source)
+    {
+        if (source == "-")
+            return STDIN_FILENO;
+        auto fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Unable to open sample source '" + source + "': " + std::strerror(errno));
+        return fd;
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_MONITOR_H
@@ -21,11 +21,26 @@
 
 #include <assign2/common.h>
 #include <assign2/layer.h>
+#include <assign2/alloc_tracker.h>
+#include <assign2/profiler.h>
 #include "blt/std/assert.h"
 #include "global_magic.h"
 
 namespace assign2
 {
+    /**
+     * scratch space for a network, sized once at construction so training and inference never touch the heap.
+     * the activations and errors of each layer live on the layer_t and are allocated up front there.
+     */
+    struct network_workspace_t
+    {
+        // targets for the sample currently being trained or evaluated
+        std::vector<Scalar> expected;
+        // stacked inputs and targets for the batched paths, sized by reserve_batch() for the largest batch and only ever grown
+        matrix_t batch_input;
+        matrix_t batch_expected;
+    };
+    
     class network_t
     {
         public:
@@ -46,6 +61,7 @@ namespace assign2
                 {
                     layers.push_back(std::make_unique<layer_t>(input_size, output_size, w, b));
                 }
+                init_workspace();
             }
             
             template<typename WeightFunc, typename BiasFunc, typename OutputWeightFunc, typename OutputBiasFunc>
@@ -66,22 +82,41 @@ namespace assign2
                 {
                     layers.push_back(std::make_unique<layer_t>(input_size, output_size, ow, ob));
                 }
+                init_workspace();
             }
             
             explicit network_t(std::vector<std::unique_ptr<layer_t>> layers): layers(std::move(layers))
-            {}
+            {
+                init_workspace();
+            }
+            
+            /**
+             * @param storage keeps memory the layers' weights point into (see layer_t's weight_view constructor) alive
+             */
+            network_t(std::vector<std::unique_ptr<layer_t>> layers, std::shared_ptr<const void> storage):
+                    layers(std::move(layers)), storage(std::move(storage))
+            {
+                init_workspace();
+            }
             
             network_t() = default;
             
-            const std::vector<Scalar>& execute(const std::vector<Scalar>& input)
+            const std::vector<Scalar>& execute(span<const Scalar> input)
             {
-                std::vector<blt::ref<const std::vector<Scalar>>> outputs;
-                outputs.emplace_back(input);
-                
-                for (auto [i, v] : blt::enumerate(layers))
-                    outputs.emplace_back(v->call(outputs.back()));
-                
-                return outputs.back();
+                ASSIGN2_ASSERT_NO_ALLOCATIONS("network_t::execute allocated");
+                for (auto& l : layers)
+                    input = l->call(input);
+                return layers.back()->outputs;
+            }
+            
+            /**
+             * runs every column of input through the network, see layer_t::call_batch
+             */
+            matrix_view_t execute_batch(const matrix_view_t& input)
+            {
+                for (auto [i, l] : blt::enumerate(layers))
+                    l->call_batch(i == 0 ? input : layers[i - 1]->batch_outputs_view());
+                return layers.back()->batch_outputs_view();
             }
             
             error_data_t error(const data_file_t& data)
@@ -89,11 +124,11 @@ namespace assign2
                 Scalar total_error = 0;
                 Scalar total_d_error = 0;
                 
+                ASSIGN2_ASSERT_NO_ALLOCATIONS("network_t::error allocated");
                 for (auto& d : data.data_points)
                 {
-                    std::vector<Scalar> expected{d.is_bad ? 0.0f : 1.0f, d.is_bad ? 1.0f : 0.0f};
-                    
-                    auto out = execute(d.bins);
+                    const auto& expected = load_expected(d);
+                    const auto& out = execute(d.bins);
                     
                     BLT_ASSERT(out.size() == expected.size());
                     for (auto [o, e] : blt::in_pairs(out, expected))
@@ -110,14 +145,34 @@ namespace assign2
                 return {total_error / static_cast<Scalar>(data.data_points.size()), total_d_error / static_cast<Scalar>(data.data_points.size())};
             }
             
+            /**
+             * @return the percentage of data the network classifies correctly
+             */
+            Scalar percent_correct(const data_file_t& data)
+            {
+                blt::size_t right = 0;
+                for (auto& d : data.data_points)
+                {
+                    if (is_thinks_bad(execute(d.bins)) == d.is_bad)
+                        right++;
+                }
+                return static_cast<Scalar>(right) / static_cast<Scalar>(data.data_points.size()) * 100;
+            }
+            
             error_data_t train(const data_t& data, bool reset)
             {
                 error_data_t error = {0, 0};
-                execute(data.bins);
-                std::vector<Scalar> expected{data.is_bad ? 0.0f : 1.0f, data.is_bad ? 1.0f : 0.0f};
+                span<const Scalar> input = data.bins;
+                for (auto [i, layer] : blt::enumerate(layers))
+                {
+                    ASSIGN2_PROFILE_LAYER_SCOPE("forward", i);
+                    input = layer->call(input);
+                }
+                const auto& expected = load_expected(data);
                 
                 for (auto [i, layer] : blt::iterate(layers).enumerate().rev())
                 {
+                    ASSIGN2_PROFILE_LAYER_SCOPE("back_prop", i);
                     if (i == layers.size() - 1)
                     {
                         error += layer->back_prop(layers[i - 1]->outputs, expected);
@@ -129,6 +184,7 @@ namespace assign2
                         error += layer->back_prop(layers[i - 1]->outputs, *layers[i + 1]);
                     }
                 }
+                ASSIGN2_PROFILE_SCOPE("update");
                 for (auto& l : layers)
                     l->update(m_omega, reset);
 //                BLT_TRACE("Error for input: %f, derr: %f", error.error, error.d_error);
@@ -137,15 +193,206 @@ namespace assign2
             
             error_data_t train_epoch(const data_file_t& example, blt::i32 trains_per_data = 1)
             {
+                ASSIGN2_PROFILE_SCOPE("train_epoch");
+                ASSIGN2_ASSERT_NO_ALLOCATIONS("network_t::train_epoch allocated");
                 error_data_t error{0, 0};
                 for (const auto& x : example.data_points)
                 {
                     for (blt::i32 i = 0; i < trains_per_data; i++)
                         error += train(x, reset_next);
                 }
+                return finish_epoch(error, example.data_points.size() * trains_per_data);
+            }
+            
+            /**
+             * @return a network of the same shape with its own copy of our weights and biases
+             */
+            [[nodiscard]] network_t clone() const
+            {
+                std::vector<std::unique_ptr<layer_t>> copies;
+                for (const auto& l : layers)
+                    copies.push_back(l->clone());
+                network_t network{std::move(copies)};
+                network.m_omega = m_omega;
+                return network;
+            }
+            
+            /**
+             * points every layer at the weights and biases of owner, see layer_t::share_weights
+             */
+            void share_weights(const network_t& owner)
+            {
+                BLT_ASSERT(owner.layers.size() == layers.size());
+                for (auto [l, o] : blt::zip(layers, owner.layers))
+                    l->share_weights(*o);
+            }
+            
+            /**
+             * @return the number of weights and biases over every layer
+             */
+            [[nodiscard]] blt::size_t parameter_count() const
+            {
+                blt::size_t total = 0;
+                for (const auto& l : layers)
+                    total += l->parameters().size();
+                return total;
+            }
+            
+            /**
+             * copies every layer's parameters() into out, one after another. out must hold parameter_count() values
+             */
+            void save_parameters(Scalar* out) const
+            {
+                for (const auto& l : layers)
+                    out = std::copy(l->parameters().begin(), l->parameters().end(), out);
+            }
+            
+            /**
+             * the reverse of save_parameters
+             */
+            void load_parameters(const Scalar* in)
+            {
+                for (auto& l : layers)
+                {
+                    const auto params = l->parameters();
+                    std::copy(in, in + params.size(), params.begin());
+                    in += params.size();
+                }
+            }
+            
+            /**
+             * @return the number of momentum values over every layer
+             */
+            [[nodiscard]] blt::size_t momentum_count() const
+            {
+                blt::size_t total = 0;
+                for (const auto& l : layers)
+                    total += l->momentum_values().size();
+                return total;
+            }
+            
+            /**
+             * copies every layer's momentum into out, one after another. out must hold momentum_count() values
+             */
+            void save_momentum(Scalar* out) const
+            {
+                for (const auto& l : layers)
+                    out = std::copy(l->momentum_values().begin(), l->momentum_values().end(), out);
+            }
+            
+            /**
+             * the reverse of save_momentum
+             */
+            void load_momentum(const Scalar* in)
+            {
+                for (auto& l : layers)
+                {
+                    const auto values = l->momentum_values();
+                    std::copy(in, in + values.size(), values.begin());
+                    in += values.size();
+                }
+            }
+            
+            /**
+             * what training carries from one epoch into the next besides the weights and momentum
+             */
+            struct epoch_state_t
+            {
+                Scalar last_d_error;
+                bool reset_next;
+            };
+            
+            [[nodiscard]] epoch_state_t epoch_state() const
+            {
+                return {last_d_error, reset_next};
+            }
+            
+            void restore_epoch_state(const epoch_state_t& state)
+            {
+                last_d_error = state.last_d_error;
+                reset_next = state.reset_next;
+            }
+            
+            [[nodiscard]] blt::size_t layer_count() const
+            {
+                return layers.size();
+            }
+            
+            [[nodiscard]] const layer_t& layer(blt::size_t i) const
+            {
+                return *layers[i];
+            }
+            
+            /**
+             * mini-batch training over data. each batch is stacked into a matrix and run through the network with GEMMs,
+             * the gradients are averaged over the batch and a single update is applied per batch.
+             * @param batch_size samples per update, 0 uses the entire span as one batch
+             */
+            error_data_t train_batch(span<const data_t> data, blt::size_t batch_size)
+            {
+                ASSIGN2_PROFILE_SCOPE("train_batch");
+                error_data_t error{0, 0};
+                if (batch_size == 0)
+                    batch_size = data.size();
+                // the workspace is only grown the first time we see a batch this large. the GEMMs themselves still malloc the packing
+                // buffers Eigen sizes from the cache, which it offers no way to keep, so this path isn't asserted allocation free
+                reserve_batch(std::min(batch_size, data.size()));
+                for (blt::size_t offset = 0; offset < data.size(); offset += batch_size)
+                {
+                    auto batch = data.subspan(offset, batch_size);
+                    error += compute_gradients(batch, learn_rate / static_cast<Scalar>(batch.size()));
+                    apply_gradients();
+                }
+                return finish_epoch(error, data.size());
+            }
+            
+            /**
+             * runs the batch forwards and back propagates it, leaving the summed gradients multiplied by scale in each layer's
+             * weight_derivatives without touching the weights. the batch must not be empty
+             */
+            error_data_t compute_gradients(span<const data_t> batch, Scalar scale)
+            {
+                error_data_t error{0, 0};
+                reserve_batch(batch.size());
+                load_batch(batch);
+                const auto count = static_cast<Eigen::Index>(batch.size());
+                const matrix_view_t input = workspace.batch_input.leftCols(count);
+                for (auto [i, layer] : blt::enumerate(layers))
+                {
+                    ASSIGN2_PROFILE_LAYER_SCOPE("forward", i);
+                    layer->call_batch(i == 0 ? input : layers[i - 1]->batch_outputs_view());
+                }
+                for (auto [i, layer] : blt::iterate(layers).enumerate().rev())
+                {
+                    ASSIGN2_PROFILE_LAYER_SCOPE("back_prop", i);
+                    const auto prev_output = i == 0 ? input : layers[i - 1]->batch_outputs_view();
+                    if (i == layers.size() - 1)
+                        error += layer->back_prop_batch(prev_output, matrix_view_t{workspace.batch_expected.leftCols(count)}, scale);
+                    else
+                        error += layer->back_prop_batch(prev_output, *layers[i + 1], scale);
+                }
+                return error;
+            }
+            
+            /**
+             * applies the gradients currently held in each layer's weight_derivatives
+             */
+            void apply_gradients()
+            {
+                ASSIGN2_PROFILE_SCOPE("update");
+                for (auto& l : layers)
+                    l->update(m_omega, reset_next);
+            }
+            
+            /**
+             * averages the summed error of an epoch over its samples and carries the direction of the error into the next epoch,
+             * for trainers driving compute_gradients() / apply_gradients() themselves
+             */
+            error_data_t finish_epoch(error_data_t error, blt::size_t samples)
+            {
                 // take the average cost over all the training.
-                error.d_error /= static_cast<Scalar>(example.data_points.size() * trains_per_data);
-                error.error /= static_cast<Scalar>(example.data_points.size() * trains_per_data);
+                error.d_error /= static_cast<Scalar>(samples);
+                error.error /= static_cast<Scalar>(samples);
                 // as long as we are reducing error in the same direction in overall terms, we should still build momentum.
                 auto last_sign = last_d_error >= 0;
                 auto cur_sign = error.d_error >= 0;
@@ -154,11 +401,22 @@ namespace assign2
                 return error;
             }
             
+            /**
+             * @return the multiply-adds needed to push one sample forwards, which training time scales with
+             */
+            [[nodiscard]] blt::size_t cost() const
+            {
+                blt::size_t total = 0;
+                for (const auto& l : layers)
+                    total += static_cast<blt::size_t>(l->get_in_size()) * static_cast<blt::size_t>(l->get_out_size());
+                return total;
+            }
+            
             void with_momentum(Scalar* omega)
             {
                 m_omega = omega;
             }
-
+            
 #ifdef BLT_USE_GRAPHICS
             
             void render(blt::gfx::batch_renderer_2d& renderer) const
@@ -166,15 +424,62 @@ namespace assign2
                 for (auto& l : layers)
                     l->render(renderer);
             }
-
+            
 #endif
         
         private:
+            void init_workspace()
+            {
+                workspace.expected.resize(layers.back()->get_out_size());
+            }
+            
+            const std::vector<Scalar>& load_expected(const data_t& data)
+            {
+                workspace.expected[0] = data.is_bad ? 0.0f : 1.0f;
+                workspace.expected[1] = data.is_bad ? 1.0f : 0.0f;
+                return workspace.expected;
+            }
+            
+            /**
+             * sizes the workspace and every layer for batches of up to batch_size samples
+             */
+            void reserve_batch(blt::size_t batch_size)
+            {
+                const auto columns = static_cast<Eigen::Index>(batch_size);
+                if (workspace.batch_input.cols() < columns)
+                {
+                    workspace.batch_input.resize(layers.front()->get_in_size(), columns);
+                    workspace.batch_expected.resize(2, columns);
+                }
+                for (auto& l : layers)
+                    l->reserve_batch(columns);
+            }
+            
+            /**
+             * stacks batch into the leading columns of the workspace, which reserve_batch() must have sized for it
+             */
+            void load_batch(span<const data_t> batch)
+            {
+                const auto input_size = static_cast<Eigen::Index>(batch.begin()->bins.size());
+                auto& batch_input = workspace.batch_input;
+                auto& batch_expected = workspace.batch_expected;
+                BLT_ASSERT(batch_input.rows() == input_size && batch_input.cols() >= static_cast<Eigen::Index>(batch.size()));
+                for (auto [i, d] : blt::enumerate(batch))
+                {
+                    const auto col = static_cast<Eigen::Index>(i);
+                    batch_input.col(col) = Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>(d.bins.data(), input_size);
+                    batch_expected(0, col) = d.is_bad ? 0.0f : 1.0f;
+                    batch_expected(1, col) = d.is_bad ? 1.0f : 0.0f;
+                }
+            }
+            
             // pointer so it can be changed from the UI
             Scalar* m_omega = nullptr;
             Scalar last_d_error = 0;
             bool reset_next = false;
             std::vector<std::unique_ptr<layer_t>> layers;
+            std::shared_ptr<const void> storage;
+            network_workspace_t workspace;
     };
 }
 
@@ -0,0 +1,188 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_PARALLEL_H
+#define COSC_4P80_ASSIGNMENT_2_PARALLEL_H
+
+#include <blt/std/types.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * @return the number of threads to use when the user didn't ask for a specific amount
+     */
+    inline blt::size_t default_thread_count()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    
+    /**
+     * runs func(i) for every i in [0, jobs) across up to thread_count threads, returning once every job is done.
+     * if a job throws the remaining jobs are skipped and the first exception is rethrown here.
+     * jobs are handed out in order as threads free up, so putting the most expensive jobs first gives a longest-first schedule.
+     */
+    template<typename Func>
+    void run_parallel(blt::size_t jobs, blt::size_t thread_count, Func&& func)
+    {
+        thread_count = std::max<blt::size_t>(1, std::min(thread_count, jobs));
+        std::atomic<blt::size_t> next_job = 0;
+        std::exception_ptr error;
+        std::mutex error_lock;
+        auto worker = [&]() {
+            try
+            {
+                for (auto job = next_job.fetch_add(1, std::memory_order_relaxed); job < jobs; job = next_job.fetch_add(1, std::memory_order_relaxed))
+                    func(job);
+            } catch (...)
+            {
+                // stop handing out work and rethrow on the calling thread once everyone is done
+                next_job = jobs;
+                std::scoped_lock lock(error_lock);
+                if (!error)
+                    error = std::current_exception();
+            }
+        };
+        
+        std::vector<std::thread> threads;
+        threads.reserve(thread_count - 1);
+        for (blt::size_t i = 1; i < thread_count; i++)
+            threads.emplace_back(worker);
+        // the calling thread does its share instead of sitting idle
+        worker();
+        for (auto& thread : threads)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+    
+    /**
+     * a fixed set of threads kept for as long as the pool lives, for work that is split the same way over and over (every batch of
+     * every epoch) where starting threads each time would cost more than the work. the calling thread is always thread 0.
+     */
+    class thread_pool_t
+    {
+        public:
+            explicit thread_pool_t(blt::size_t thread_count): thread_count(std::max<blt::size_t>(1, thread_count))
+            {
+                workers.reserve(this->thread_count - 1);
+                for (blt::size_t t = 1; t < this->thread_count; t++)
+                    workers.emplace_back([this, t]() { work(t); });
+            }
+            
+            thread_pool_t(const thread_pool_t&) = delete;
+            
+            thread_pool_t& operator=(const thread_pool_t&) = delete;
+            
+            ~thread_pool_t()
+            {
+                {
+                    std::scoped_lock lock(mutex);
+                    stopping = true;
+                }
+                start.notify_all();
+                for (auto& worker : workers)
+                    worker.join();
+            }
+            
+            [[nodiscard]] blt::size_t size() const
+            {
+                return thread_count;
+            }
+            
+            /**
+             * runs func(t) once on every thread t in [0, size()) and returns once they have all finished, which makes every call
+             * a barrier. if any of them throws the first exception is rethrown here. doesn't allocate.
+             */
+            template<typename Func>
+            void run(Func&& func)
+            {
+                {
+                    std::scoped_lock lock(mutex);
+                    task = [](void* context, blt::size_t t) { (*static_cast<std::remove_reference_t<Func>*>(context))(t); };
+                    context = const_cast<void*>(static_cast<const void*>(&func));
+                    remaining = thread_count - 1;
+                    generation++;
+                }
+                start.notify_all();
+                call(0);
+                
+                std::unique_lock lock(mutex);
+                finished.wait(lock, [this]() { return remaining == 0; });
+                if (error)
+                    std::rethrow_exception(std::exchange(error, nullptr));
+            }
+        
+        private:
+            void work(blt::size_t t)
+            {
+                blt::size_t seen = 0;
+                while (true)
+                {
+                    {
+                        std::unique_lock lock(mutex);
+                        start.wait(lock, [this, seen]() { return generation != seen || stopping; });
+                        if (stopping)
+                            return;
+                        seen = generation;
+                    }
+                    call(t);
+                    std::scoped_lock lock(mutex);
+                    if (--remaining == 0)
+                        finished.notify_one();
+                }
+            }
+            
+            void call(blt::size_t t)
+            {
+                try
+                {
+                    task(context, t);
+                } catch (...)
+                {
+                    std::scoped_lock lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+            }
+            
+            const blt::size_t thread_count;
+            std::vector<std::thread> workers;
+            
+            std::mutex mutex;
+            std::condition_variable start;
+            std::condition_variable finished;
+            // the current job, type erased without allocating
+            void (* task)(void*, blt::size_t) = nullptr;
+            void* context = nullptr;
+            blt::size_t generation = 0;
+            blt::size_t remaining = 0;
+            bool stopping = false;
+            std::exception_ptr error;
+    };
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_PARALLEL_H
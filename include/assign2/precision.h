@@ -0,0 +1,240 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_PRECISION_H
+#define COSC_4P80_ASSIGNMENT_2_PRECISION_H
+
+#include <assign2/common.h>
+#include <assign2/functions.h>
+#include <assign2/kernels.h>
+#include <assign2/network.h>
+#include <assign2/alloc_tracker.h>
+#include <type_traits>
+#include <vector>
+
+namespace assign2
+{
+    /*
+     * inference at other precisions. a trained network_t is copied into a typed_network_t which keeps its weights as Storage and
+     * does the arithmetic in Compute. fp16 and bf16 storage halve the bytes read per inference (the 1000 bin network's first
+     * layer drops from ~2MB to ~1MB) while still accumulating in float, and fp64 gives a reference to check float against.
+     * training always happens in float on network_t.
+     */
+    
+    /**
+     * sum(w[i] * x[i]) accumulated in Compute
+     */
+    template<typename Storage, typename Compute>
+    Compute typed_dot(const Storage* w, const Compute* x, blt::size_t count)
+    {
+        if constexpr (std::is_same_v<Storage, Eigen::half> && std::is_same_v<Compute, Scalar>)
+            return half_kernels().dot_fp16(w, x, count);
+        else if constexpr (std::is_same_v<Storage, Eigen::bfloat16> && std::is_same_v<Compute, Scalar>)
+            return half_kernels().dot_bf16(w, x, count);
+        else if constexpr (std::is_same_v<Storage, Scalar> && std::is_same_v<Compute, Scalar>)
+            return kernels().dot(w, x, count);
+        else
+        {
+            Compute sum = 0;
+            for (blt::size_t i = 0; i < count; i++)
+                sum += static_cast<Compute>(w[i]) * x[i];
+            return sum;
+        }
+    }
+    
+    /**
+     * out[i] = activation(in[i]) in Compute. float goes through the activation's own apply(), anything else through the built in
+     * functions' call<Compute>(). a function only known as a function_t can only be evaluated in float
+     */
+    template<typename Compute>
+    void typed_activation(const activation_t& activation, const std::vector<Compute>& in, std::vector<Compute>& out)
+    {
+        visit_activation(activation, [&](const auto& act) {
+            if constexpr (std::is_same_v<Compute, Scalar>)
+                act.apply(in, out);
+            else if constexpr (std::is_same_v<std::decay_t<decltype(act)>, function_t>)
+            {
+                for (blt::size_t i = 0; i < in.size(); i++)
+                    out[i] = static_cast<Compute>(act.call(static_cast<Scalar>(in[i])));
+            } else
+            {
+                for (blt::size_t i = 0; i < in.size(); i++)
+                    out[i] = act.template call<Compute>(in[i]);
+            }
+        });
+    }
+    
+    template<typename Storage, typename Compute = Scalar>
+    class typed_layer_t
+    {
+        public:
+            explicit typed_layer_t(const layer_t& layer):
+                    in_size(static_cast<blt::size_t>(layer.get_in_size())), out_size(static_cast<blt::size_t>(layer.get_out_size())),
+                    // a built in function held through a function_t* is swapped for its by value form, which has call<Compute>()
+                    activation(make_activation(activation_id(layer.get_activation())).value_or(layer.get_activation())),
+                    weights(in_size * out_size), bias(out_size), z(out_size), outputs(out_size)
+            {
+                const auto params = layer.parameters();
+                for (blt::size_t i = 0; i < weights.size(); i++)
+                    weights[i] = static_cast<Storage>(params[i]);
+                for (blt::size_t i = 0; i < out_size; i++)
+                    bias[i] = static_cast<Compute>(params[weights.size() + i]);
+            }
+            
+            const std::vector<Compute>& call(const std::vector<Compute>& in)
+            {
+                for (blt::size_t r = 0; r < out_size; r++)
+                    z[r] = bias[r] + typed_dot(weights.data() + r * in_size, in.data(), in_size);
+                typed_activation(activation, z, outputs);
+                return outputs;
+            }
+            
+            [[nodiscard]] blt::size_t get_in_size() const
+            {
+                return in_size;
+            }
+            
+            [[nodiscard]] blt::size_t weight_bytes() const
+            {
+                return weights.size() * sizeof(Storage);
+            }
+        
+        private:
+            blt::size_t in_size, out_size;
+            activation_t activation;
+            // out_size x in_size row-major, like layer_t
+            std::vector<Storage> weights;
+            std::vector<Compute> bias;
+            std::vector<Compute> z;
+            std::vector<Compute> outputs;
+    };
+    
+    /**
+     * bins stored as Storage, for keeping datasets at reduced precision as well
+     */
+    template<typename Storage>
+    struct typed_data_file_t
+    {
+        blt::size_t bin_count = 0;
+        // one point per row
+        std::vector<Storage> bins;
+        std::vector<bool> is_bad;
+        
+        [[nodiscard]] blt::size_t size() const
+        {
+            return is_bad.size();
+        }
+        
+        [[nodiscard]] const Storage* point(blt::size_t i) const
+        {
+            return bins.data() + i * bin_count;
+        }
+    };
+    
+    template<typename Storage>
+    typed_data_file_t<Storage> convert_data_file(const data_file_t& data)
+    {
+        typed_data_file_t<Storage> converted;
+        converted.bin_count = data.data_points.empty() ? 0 : data.data_points.front().bins.size();
+        converted.bins.reserve(data.data_points.size() * converted.bin_count);
+        for (const auto& d : data.data_points)
+        {
+            for (auto v : d.bins)
+                converted.bins.push_back(static_cast<Storage>(v));
+            converted.is_bad.push_back(d.is_bad);
+        }
+        return converted;
+    }
+    
+    /**
+     * a copy of a network_t for inference with weights stored as Storage and arithmetic done in Compute
+     */
+    template<typename Storage, typename Compute = Scalar>
+    class typed_network_t
+    {
+        public:
+            explicit typed_network_t(const network_t& network)
+            {
+                for (blt::size_t i = 0; i < network.layer_count(); i++)
+                    layers.emplace_back(network.layer(i));
+                input.resize(layers.front().get_in_size());
+            }
+            
+            /**
+             * @param in in_size values of any type convertible to Compute
+             */
+            template<typename T>
+            const std::vector<Compute>& execute(const T* in)
+            {
+                ASSIGN2_ASSERT_NO_ALLOCATIONS("typed_network_t::execute allocated");
+                for (blt::size_t i = 0; i < input.size(); i++)
+                    input[i] = static_cast<Compute>(in[i]);
+                const auto* values = &input;
+                for (auto& l : layers)
+                    values = &l.call(*values);
+                return *values;
+            }
+            
+            const std::vector<Compute>& execute(span<const Scalar> in)
+            {
+                return execute(in.data());
+            }
+            
+            Scalar percent_correct(const data_file_t& data)
+            {
+                blt::size_t right = 0;
+                for (auto& d : data.data_points)
+                {
+                    if (is_thinks_bad<Compute>(execute(d.bins)) == d.is_bad)
+                        right++;
+                }
+                return static_cast<Scalar>(right) / static_cast<Scalar>(data.data_points.size()) * 100;
+            }
+            
+            template<typename T>
+            Scalar percent_correct(const typed_data_file_t<T>& data)
+            {
+                blt::size_t right = 0;
+                for (blt::size_t i = 0; i < data.size(); i++)
+                {
+                    if (is_thinks_bad<Compute>(execute(data.point(i))) == data.is_bad[i])
+                        right++;
+                }
+                return static_cast<Scalar>(right) / static_cast<Scalar>(data.size()) * 100;
+            }
+            
+            [[nodiscard]] blt::size_t weight_bytes() const
+            {
+                blt::size_t total = 0;
+                for (const auto& l : layers)
+                    total += l.weight_bytes();
+                return total;
+            }
+        
+        private:
+            std::vector<typed_layer_t<Storage, Compute>> layers;
+            std::vector<Compute> input;
+    };
+    
+    using fp16_network_t = typed_network_t<Eigen::half>;
+    using bf16_network_t = typed_network_t<Eigen::bfloat16>;
+    // float64 weights and arithmetic, the reference the others are checked against
+    using fp64_network_t = typed_network_t<double, double>;
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_PRECISION_H
@@ -0,0 +1,377 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_PROFILER_H
+#define COSC_4P80_ASSIGNMENT_2_PROFILER_H
+
+#include <blt/std/types.h>
+#include <blt/std/logging.h>
+#include <assign2/alloc_tracker.h>
+
+/**
+ * when ASSIGN2_PROFILING is defined ASSIGN2_PROFILE_SCOPE(name) times the enclosing scope as the phase name, and
+ * ASSIGN2_PROFILE_LAYER_SCOPE(name, layer) as that phase of one layer, while profiling_enabled is set. name must be a string
+ * literal. without the define both compile to nothing, with it and profiling off they cost a relaxed load and a branch.
+ */
+#ifdef ASSIGN2_PROFILING
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace assign2
+{
+    /*
+     * every thread records into its own thread_profile_t which only that thread writes, so recording takes no locks. a thread takes
+     * the profiler's lock the first time it records to take a free buffer, and again when it exits to hand the buffer back, so the
+     * threads run_parallel makes on every call reuse the same few buffers instead of each adding another. start() makes the buffers
+     * up front so taking one doesn't allocate. events go into a fixed size buffer which stops taking events once full, the histograms
+     * keep counting every scope regardless so they always cover the whole run.
+     */
+    
+    inline std::atomic_bool profiling_enabled = false;
+    
+    struct profile_event_t
+    {
+        const char* name;
+        blt::i32 layer;
+        std::uint64_t start_ns;
+        std::uint64_t duration_ns;
+    };
+    
+    /**
+     * durations of one phase, bucket i counts those under 2^i ns (and at least 2^(i-1) ns)
+     */
+    struct phase_histogram_t
+    {
+        const char* name = nullptr;
+        blt::i32 layer = -1;
+        std::uint64_t count = 0;
+        std::uint64_t total_ns = 0;
+        std::uint64_t min_ns = ~std::uint64_t{0};
+        std::uint64_t max_ns = 0;
+        std::array<std::uint64_t, 64> buckets{};
+        
+        void add(std::uint64_t duration_ns)
+        {
+            count++;
+            total_ns += duration_ns;
+            min_ns = std::min(min_ns, duration_ns);
+            max_ns = std::max(max_ns, duration_ns);
+            // the bucket is the bit width of the duration
+            const auto bucket = duration_ns == 0 ? 0 : 64 - __builtin_clzll(duration_ns);
+            buckets[std::min<blt::size_t>(bucket, buckets.size() - 1)]++;
+        }
+        
+        void merge(const phase_histogram_t& other)
+        {
+            count += other.count;
+            total_ns += other.total_ns;
+            min_ns = std::min(min_ns, other.min_ns);
+            max_ns = std::max(max_ns, other.max_ns);
+            for (blt::size_t i = 0; i < buckets.size(); i++)
+                buckets[i] += other.buckets[i];
+        }
+        
+        static constexpr std::uint64_t bucket_upper_ns(blt::size_t bucket)
+        {
+            return (std::uint64_t{1} << bucket) - 1;
+        }
+        
+        /**
+         * @return the upper bound of the bucket holding the pth fraction of durations
+         */
+        [[nodiscard]] std::uint64_t percentile_ns(double p) const
+        {
+            const auto target = static_cast<std::uint64_t>(p * static_cast<double>(count));
+            std::uint64_t seen = 0;
+            for (blt::size_t i = 0; i < buckets.size(); i++)
+            {
+                seen += buckets[i];
+                if (seen > target)
+                    return std::min(max_ns, bucket_upper_ns(i));
+            }
+            return max_ns;
+        }
+    };
+    
+    class thread_profile_t
+    {
+        public:
+            thread_profile_t(blt::size_t thread_id, blt::size_t capacity): thread_id(thread_id), events(capacity)
+            {}
+            
+            void record(const char* name, blt::i32 layer, std::uint64_t start_ns, std::uint64_t duration_ns)
+            {
+                const auto n = event_count.load(std::memory_order_relaxed);
+                if (n < events.size())
+                {
+                    events[n] = {name, layer, start_ns, duration_ns};
+                    // publishes the event to an export running on another thread
+                    event_count.store(n + 1, std::memory_order_release);
+                } else
+                    dropped++;
+                
+                // there are only a handful of phases, a scan over them beats hashing
+                for (auto& h : histograms)
+                {
+                    if (h.name == name && h.layer == layer)
+                    {
+                        h.add(duration_ns);
+                        return;
+                    }
+                    if (h.name == nullptr)
+                    {
+                        h.name = name;
+                        h.layer = layer;
+                        h.add(duration_ns);
+                        return;
+                    }
+                }
+                dropped_phases++;
+            }
+            
+            const blt::size_t thread_id;
+            std::vector<profile_event_t> events;
+            std::atomic<blt::size_t> event_count = 0;
+            blt::size_t dropped = 0;
+            std::array<phase_histogram_t, 64> histograms{};
+            blt::size_t dropped_phases = 0;
+    };
+    
+    class profiler_t
+    {
+        public:
+            /**
+             * starts recording, every buffer has room for events_per_thread trace events
+             * @param thread_count buffers to make now, one per thread expected to record at once. threads past that allocate theirs
+             * the first time they record
+             */
+            void start(blt::size_t events_per_thread = 1ul << 18, blt::size_t thread_count = 1)
+            {
+                std::scoped_lock lock(mutex);
+                capacity = events_per_thread;
+                while (free_buffers.size() < thread_count)
+                    add_buffer();
+                epoch = std::chrono::steady_clock::now();
+                profiling_enabled.store(true, std::memory_order_relaxed);
+            }
+            
+            void stop()
+            {
+                profiling_enabled.store(false, std::memory_order_relaxed);
+            }
+            
+            [[nodiscard]] std::uint64_t now_ns() const
+            {
+                return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - epoch).count());
+            }
+            
+            /**
+             * @return the calling thread's buffer, taking a free one the first time
+             */
+            thread_profile_t& local()
+            {
+                thread_local buffer_handle_t handle;
+                if (handle.profile == nullptr)
+                    handle.profile = acquire();
+                return *handle.profile;
+            }
+            
+            /**
+             * writes every recorded event in the Chrome trace event format, for chrome://tracing or https://ui.perfetto.dev
+             */
+            void write_chrome_trace(const std::string& path)
+            {
+                std::scoped_lock lock(mutex);
+                std::ofstream stream{path};
+                stream << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+                bool first = true;
+                for (const auto& t : threads)
+                {
+                    const auto count = t->event_count.load(std::memory_order_acquire);
+                    for (blt::size_t i = 0; i < count; i++)
+                    {
+                        const auto& e = t->events[i];
+                        stream << (first ? "" : ",\n") << "{\"name\": \"" << phase_name(e.name, e.layer) << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+                               << t->thread_id << ", \"ts\": " << static_cast<double>(e.start_ns) / 1000.0 << ", \"dur\": "
+                               << static_cast<double>(e.duration_ns) / 1000.0 << "}";
+                        first = false;
+                    }
+                    if (t->dropped > 0)
+                        BLT_WARN("Thread %ld dropped %ld trace events once its buffer filled, its histograms still include them", t->thread_id,
+                                 t->dropped);
+                }
+                stream << "\n]}\n";
+            }
+            
+            /**
+             * @return every phase's histogram summed over all threads, ordered by name. call once the profiled threads are done,
+             * histograms aren't published the way events are
+             */
+            std::vector<std::pair<std::string, phase_histogram_t>> histograms()
+            {
+                std::scoped_lock lock(mutex);
+                std::map<std::string, phase_histogram_t> merged;
+                for (const auto& t : threads)
+                {
+                    for (const auto& h : t->histograms)
+                    {
+                        if (h.name != nullptr)
+                            merged[phase_name(h.name, h.layer)].merge(h);
+                    }
+                    if (t->dropped_phases > 0)
+                        BLT_WARN("Thread %ld recorded more than %ld phases, %ld scopes weren't counted", t->thread_id, t->histograms.size(),
+                                 t->dropped_phases);
+                }
+                return {merged.begin(), merged.end()};
+            }
+            
+            /**
+             * writes histograms() as CSV, the last column lists the non-empty buckets as upper_bound_ns:count
+             */
+            void write_histograms(const std::string& path)
+            {
+                std::ofstream stream{path};
+                stream << "phase,count,total_ns,mean_ns,min_ns,max_ns,p50_ns,p90_ns,p99_ns,buckets\n";
+                for (const auto& [name, h] : histograms())
+                {
+                    stream << name << ',' << h.count << ',' << h.total_ns << ',' << h.total_ns / std::max<std::uint64_t>(h.count, 1) << ','
+                           << h.min_ns << ',' << h.max_ns << ',' << h.percentile_ns(0.5) << ',' << h.percentile_ns(0.9) << ','
+                           << h.percentile_ns(0.99) << ',';
+                    for (blt::size_t i = 0; i < h.buckets.size(); i++)
+                    {
+                        if (h.buckets[i] > 0)
+                            stream << phase_histogram_t::bucket_upper_ns(i) << ':' << h.buckets[i] << ' ';
+                    }
+                    stream << '\n';
+                }
+            }
+        
+        private:
+            /**
+             * hands the thread's buffer back when it exits
+             */
+            struct buffer_handle_t
+            {
+                thread_profile_t* profile = nullptr;
+                
+                ~buffer_handle_t();
+            };
+            
+            thread_profile_t* acquire()
+            {
+                std::scoped_lock lock(mutex);
+                if (free_buffers.empty())
+                    add_buffer();
+                auto profile = free_buffers.back();
+                free_buffers.pop_back();
+                return profile;
+            }
+            
+            void release(thread_profile_t* profile)
+            {
+                std::scoped_lock lock(mutex);
+                // has room for every buffer, see add_buffer()
+                free_buffers.push_back(profile);
+            }
+            
+            void add_buffer()
+            {
+                threads.push_back(std::make_unique<thread_profile_t>(threads.size(), capacity));
+                free_buffers.reserve(threads.size());
+                free_buffers.push_back(threads.back().get());
+            }
+            
+            static std::string phase_name(const char* name, blt::i32 layer)
+            {
+                return layer < 0 ? std::string(name) : std::string(name) + " layer " + std::to_string(layer);
+            }
+            
+            std::mutex mutex;
+            // every buffer ever made, a thread_id in the trace is one of these, recorded into by each thread that held it in turn
+            std::vector<std::unique_ptr<thread_profile_t>> threads;
+            std::vector<thread_profile_t*> free_buffers;
+            blt::size_t capacity = 1ul << 18;
+            std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    };
+    
+    inline profiler_t& profiler()
+    {
+        static profiler_t profiler;
+        return profiler;
+    }
+    
+    inline profiler_t::buffer_handle_t::~buffer_handle_t()
+    {
+        if (profile != nullptr)
+            profiler().release(profile);
+    }
+    
+    class profile_scope_t
+    {
+        public:
+            // the thread's buffer is taken here rather than when recording, so a scope opened before a no allocation scope keeps the
+            // first use of the buffer on a thread outside of it
+            explicit profile_scope_t(const char* name, blt::i32 layer = -1): name(name), layer(layer)
+            {
+                if (profiling_enabled.load(std::memory_order_relaxed))
+                {
+                    auto& p = profiler();
+                    profile = &p.local();
+                    start = p.now_ns();
+                }
+            }
+            
+            profile_scope_t(const profile_scope_t&) = delete;
+            
+            profile_scope_t& operator=(const profile_scope_t&) = delete;
+            
+            ~profile_scope_t()
+            {
+                if (profile != nullptr)
+                    profile->record(name, layer, start, profiler().now_ns() - start);
+            }
+        
+        private:
+            const char* name;
+            blt::i32 layer;
+            thread_profile_t* profile = nullptr;
+            std::uint64_t start = 0;
+    };
+}
+    
+    #define ASSIGN2_PROFILE_SCOPE(name) const assign2::profile_scope_t ASSIGN2_CONCAT(profile_scope_, __LINE__){name}
+    #define ASSIGN2_PROFILE_LAYER_SCOPE(name, layer) const assign2::profile_scope_t ASSIGN2_CONCAT(profile_scope_, __LINE__){name, \
+        static_cast<blt::i32>(layer)}
+#else
+    #define ASSIGN2_PROFILE_SCOPE(name)
+    #define ASSIGN2_PROFILE_LAYER_SCOPE(name, layer)
+#endif
+
+#endif //COSC_4P80_ASSIGNMENT_2_PROFILER_H
@@ -0,0 +1,220 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_QUANTIZE_H
+#define COSC_4P80_ASSIGNMENT_2_QUANTIZE_H
+
+#include <assign2/common.h>
+#include <assign2/functions.h>
+#include <assign2/kernels.h>
+#include <assign2/network.h>
+#include <assign2/alloc_tracker.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace assign2
+{
+    /*
+     * post-training int8 quantization for inference.
+     *
+     * each row of a weight matrix is stored as int8 with its own scale, w ~= row_scale * q_w with q_w in [-127, 127].
+     * each layer's input is stored as uint8 with a scale and zero point calibrated from the float network, x ~= input_scale *
+     * (q_x - zero_point) with q_x in [0, 127] (7 bits so the pmaddubsw kernel can't saturate). a neuron is then
+     *  z = bias + row_scale * input_scale * (sum(q_w * q_x) - zero_point * sum(q_w))
+     * where the dot product is done in integers and sum(q_w) is computed ahead of time. the biases and activations stay float.
+     */
+    
+    inline constexpr std::int32_t quantized_input_max = 127;
+    inline constexpr std::int32_t quantized_weight_max = 127;
+    
+    class quantized_layer_t
+    {
+        public:
+            /**
+             * @param input_min, input_max the range of inputs seen while calibrating
+             */
+            quantized_layer_t(const layer_t& layer, Scalar input_min, Scalar input_max):
+                    in_size(layer.get_in_size()), out_size(layer.get_out_size()), activation(layer.get_activation())
+            {
+                // zero has to be exact so it is always inside the range
+                input_min = std::min<Scalar>(input_min, 0);
+                input_max = std::max<Scalar>(input_max, 0);
+                input_scale = input_max > input_min ? (input_max - input_min) / quantized_input_max : 1;
+                inverse_input_scale = 1 / input_scale;
+                zero_point = std::clamp(static_cast<std::int32_t>(std::lround(-input_min / input_scale)), 0, quantized_input_max);
+                
+                const auto params = layer.parameters();
+                const auto columns = static_cast<blt::size_t>(in_size);
+                weights.resize(columns * out_size);
+                row_scales.resize(out_size);
+                row_sums.resize(out_size);
+                bias.assign(params.begin() + static_cast<std::ptrdiff_t>(columns * out_size), params.end());
+                for (blt::size_t r = 0; r < static_cast<blt::size_t>(out_size); r++)
+                {
+                    const auto* row = params.data() + r * columns;
+                    Scalar largest = 0;
+                    for (blt::size_t c = 0; c < columns; c++)
+                        largest = std::max(largest, std::abs(row[c]));
+                    const Scalar scale = largest > 0 ? largest / quantized_weight_max : 1;
+                    std::int32_t sum = 0;
+                    for (blt::size_t c = 0; c < columns; c++)
+                    {
+                        const auto q = std::clamp(static_cast<std::int32_t>(std::lround(row[c] / scale)), -quantized_weight_max,
+                                                  quantized_weight_max);
+                        weights[r * columns + c] = static_cast<std::int8_t>(q);
+                        sum += q;
+                    }
+                    row_scales[r] = scale * input_scale;
+                    row_sums[r] = sum * zero_point;
+                }
+                
+                quantized_input.resize(columns);
+                z.resize(out_size);
+                outputs.resize(out_size);
+            }
+            
+            const std::vector<Scalar>& call(span<const Scalar> in)
+            {
+                for (blt::size_t i = 0; i < static_cast<blt::size_t>(in_size); i++)
+                    quantized_input[i] = static_cast<std::uint8_t>(
+                            std::clamp(static_cast<std::int32_t>(std::lrint(in[i] * inverse_input_scale)) + zero_point, 0, quantized_input_max));
+                
+                const auto& k = int8_kernels();
+                const auto columns = static_cast<blt::size_t>(in_size);
+                for (blt::size_t r = 0; r < static_cast<blt::size_t>(out_size); r++)
+                {
+                    const auto acc = k.dot(quantized_input.data(), weights.data() + r * columns, columns) - row_sums[r];
+                    z[r] = bias[r] + row_scales[r] * static_cast<Scalar>(acc);
+                }
+                visit_activation(activation, [this](const auto& act) { act.apply(z, outputs); });
+                return outputs;
+            }
+            
+            [[nodiscard]] const std::vector<Scalar>& get_outputs() const
+            {
+                return outputs;
+            }
+            
+            /**
+             * @return bytes of weights, a quarter of the float layer's
+             */
+            [[nodiscard]] blt::size_t weight_bytes() const
+            {
+                return weights.size() * sizeof(std::int8_t);
+            }
+        
+        private:
+            blt::i32 in_size, out_size;
+            activation_t activation;
+            Scalar input_scale = 1;
+            Scalar inverse_input_scale = 1;
+            std::int32_t zero_point = 0;
+            // out_size x in_size row-major
+            std::vector<std::int8_t> weights;
+            // row scale times input scale, what the integer dot product is multiplied by
+            std::vector<Scalar> row_scales;
+            // zero_point * sum(q_w) of each row
+            std::vector<std::int32_t> row_sums;
+            std::vector<Scalar> bias;
+            
+            std::vector<std::uint8_t> quantized_input;
+            std::vector<Scalar> z;
+            std::vector<Scalar> outputs;
+    };
+    
+    /**
+     * an int8 copy of a network_t for inference only, see quantize_network()
+     */
+    class quantized_network_t
+    {
+        public:
+            explicit quantized_network_t(std::vector<quantized_layer_t> layers): layers(std::move(layers))
+            {}
+            
+            const std::vector<Scalar>& execute(span<const Scalar> input)
+            {
+                ASSIGN2_ASSERT_NO_ALLOCATIONS("quantized_network_t::execute allocated");
+                for (auto& l : layers)
+                    input = l.call(input);
+                return layers.back().get_outputs();
+            }
+            
+            /**
+             * @return the percentage of data the network classifies correctly
+             */
+            Scalar percent_correct(const data_file_t& data)
+            {
+                blt::size_t right = 0;
+                for (auto& d : data.data_points)
+                {
+                    if (is_thinks_bad(execute(d.bins)) == d.is_bad)
+                        right++;
+                }
+                return static_cast<Scalar>(right) / static_cast<Scalar>(data.data_points.size()) * 100;
+            }
+            
+            [[nodiscard]] blt::size_t weight_bytes() const
+            {
+                blt::size_t total = 0;
+                for (const auto& l : layers)
+                    total += l.weight_bytes();
+                return total;
+            }
+        
+        private:
+            std::vector<quantized_layer_t> layers;
+    };
+    
+    /**
+     * quantizes network, calibrating the range of every layer's input on the points of calibration
+     */
+    inline quantized_network_t quantize_network(network_t& network, const data_file_t& calibration)
+    {
+        std::vector<Scalar> mins(network.layer_count(), std::numeric_limits<Scalar>::max());
+        std::vector<Scalar> maxes(network.layer_count(), std::numeric_limits<Scalar>::lowest());
+        const auto observe = [&](blt::size_t l, span<const Scalar> values) {
+            for (auto v : values)
+            {
+                mins[l] = std::min(mins[l], v);
+                maxes[l] = std::max(maxes[l], v);
+            }
+        };
+        for (const auto& d : calibration.data_points)
+        {
+            network.execute(d.bins);
+            observe(0, d.bins);
+            // each layer's input is the output of the one before it
+            for (blt::size_t l = 1; l < network.layer_count(); l++)
+                observe(l, network.layer(l - 1).get_outputs());
+        }
+        
+        std::vector<quantized_layer_t> layers;
+        for (blt::size_t l = 0; l < network.layer_count(); l++)
+        {
+            if (mins[l] > maxes[l])
+                mins[l] = maxes[l] = 0;
+            layers.emplace_back(network.layer(l), mins[l], maxes[l]);
+        }
+        return quantized_network_t{std::move(layers)};
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_QUANTIZE_H
@@ -0,0 +1,148 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_SCHEDULER_H
+#define COSC_4P80_ASSIGNMENT_2_SCHEDULER_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/metrics.h>
+#include <assign2/checkpoint.h>
+#include <assign2/parallel.h>
+#include <assign2/data_parallel.h>
+#include <algorithm>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+namespace assign2
+{
+    /**
+     * one network to train along with the data it uses. the network and data are borrowed and must outlive the job,
+     * the metrics are filled in by train_all()
+     */
+    struct training_job_t
+    {
+        blt::i32 id;
+        network_t* network;
+        const data_file_t* training;
+        const data_file_t* testing;
+        training_metrics_t metrics{};
+        
+        /**
+         * @return the estimated amount of work needed for a single epoch of this job
+         */
+        [[nodiscard]] blt::size_t cost() const
+        {
+            // a training pass is about three forward passes (forward, back prop, update), evaluation then runs the training data
+            // forwards once and the testing data twice (error and percent correct)
+            const auto samples = training->data_points.size() * 3 + training->data_points.size() + testing->data_points.size() * 2;
+            return network->cost() * samples;
+        }
+    };
+    
+    /**
+     * @return how many threads each job trains with. with no more threads than jobs every job gets one. otherwise every job gets
+     * one and each spare thread goes to whichever job has the most work per thread at that point, which evens out how long the jobs
+     * take so the most expensive one stops being the whole critical path
+     */
+    inline std::vector<blt::size_t> share_threads(const std::vector<training_job_t>& jobs, blt::size_t thread_count)
+    {
+        std::vector<blt::size_t> threads(jobs.size(), 1);
+        for (blt::size_t spare = jobs.size(); spare < thread_count; spare++)
+        {
+            blt::size_t busiest = 0;
+            for (blt::size_t j = 1; j < jobs.size(); j++)
+            {
+                if (static_cast<double>(jobs[j].cost()) / static_cast<double>(threads[j]) >
+                    static_cast<double>(jobs[busiest].cost()) / static_cast<double>(threads[busiest]))
+                    busiest = j;
+            }
+            threads[busiest]++;
+        }
+        return threads;
+    }
+    
+    /**
+     * trains every job for the given number of epochs over thread_count threads. with fewer threads than jobs they are started most
+     * expensive first so the largest network begins right away and the cheaper ones fill in the other threads around it. with more,
+     * per-sample training keeps every job on one thread, the spare threads only help by running more jobs at once. with a batch_size
+     * the threads are instead split over the jobs by share_threads() and a job given several trains over them with
+     * data_parallel_trainer_t, which gives the same result as training it on one thread.
+     * @param checkpoints if set each job is checkpointed in the background as it trains and once more when it finishes
+     */
+    inline void train_all(std::vector<training_job_t>& jobs, blt::size_t epochs, blt::size_t thread_count = default_thread_count(),
+                          std::optional<blt::size_t> batch_size = {}, const std::optional<checkpoint_options_t>& checkpoints = {})
+    {
+        std::vector<blt::size_t> order(jobs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&jobs](auto a, auto b) {
+            return jobs[a].cost() > jobs[b].cost();
+        });
+        const auto threads = batch_size ? share_threads(jobs, thread_count) : std::vector<blt::size_t>(jobs.size(), 1);
+        
+        run_parallel(order.size(), thread_count, [&](blt::size_t i) {
+            auto& job = jobs[order[i]];
+            const auto job_threads = threads[order[i]];
+            job.metrics.reserve(epochs);
+            blt::size_t first_epoch = 0;
+            std::optional<checkpointer_t> checkpointer;
+            if (checkpoints)
+            {
+                const auto path = checkpoint_path(checkpoints->directory, job.id);
+                if (checkpoints->resume)
+                {
+                    if (auto checkpoint = read_checkpoint(path))
+                    {
+                        if (checkpoint->restore(*job.network, job.metrics))
+                        {
+                            first_epoch = checkpoint->epoch;
+                            BLT_INFO("Resuming network %d from epoch %ld", job.id, first_epoch);
+                        } else
+                            BLT_WARN("Checkpoint '%s' is for a different network, starting over", path.c_str());
+                    }
+                }
+                checkpointer.emplace(path, checkpoints->every_epochs, checkpoints->every_seconds);
+            }
+            
+            // made after restoring the checkpoint since it copies state out of the network
+            std::optional<data_parallel_trainer_t> data_parallel;
+            if (job_threads > 1)
+            {
+                BLT_INFO("Training network %d over %ld threads", job.id, job_threads);
+                data_parallel.emplace(*job.network, job_threads);
+            }
+            
+            for (blt::size_t epoch = first_epoch; epoch < epochs; epoch++)
+            {
+                error_data_t error{0, 0};
+                if (data_parallel)
+                    error = data_parallel->train_epoch(*job.training, *batch_size);
+                else
+                    error = batch_size ? job.network->train_batch(job.training->data_points, *batch_size) : job.network->train_epoch(*job.training);
+                evaluate(*job.network, error, *job.training, *job.testing, job.metrics);
+                if (checkpointer)
+                    checkpointer->epoch_finished(*job.network, job.metrics, epoch + 1);
+            }
+            if (checkpointer && first_epoch < epochs)
+                checkpointer->snapshot(*job.network, job.metrics, epochs);
+        });
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_SCHEDULER_H
@@ -0,0 +1,568 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_SERVER_H
+#define COSC_4P80_ASSIGNMENT_2_SERVER_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/distributed.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace assign2
+{
+    /*
+     * batched inference over a unix domain socket. a client can send any number of requests on its connection without waiting
+     * for the replies, each request is
+     *  inference_request_header_t      an id chosen by the client and the number of bins
+     *  bins                            bin_count floats, the server hangs up on a bin_count larger than its largest network takes
+     * and each reply, in whatever order the batches finish, is
+     *  inference_reply_header_t        the id of the request, the verdict (1 if the network thinks the motor is bad, 0 if good
+     *                                  and -1 if there is no network for that many bins) and the number of outputs
+     *  outputs                         output_count floats, the raw outputs of the network
+     */
+    
+    struct inference_request_header_t
+    {
+        std::uint64_t id;
+        std::uint32_t bin_count;
+        std::uint32_t reserved;
+    };
+    
+    struct inference_reply_header_t
+    {
+        std::uint64_t id;
+        std::int32_t verdict;
+        std::uint32_t output_count;
+    };
+    
+    /**
+     * one client. replies for it come from every batcher, they are queued here and written by the connection's own thread so a client
+     * that is slow to read only holds up itself. a client that lets more than max_pending_bytes of replies pile up, or takes none of
+     * them for reply_timeout, is dropped.
+     */
+    class inference_connection_t
+    {
+        public:
+            static constexpr blt::size_t max_pending_bytes = 1 << 20;
+            static constexpr std::chrono::seconds reply_timeout{5};
+            
+            explicit inference_connection_t(int fd): fd(fd)
+            {
+                timeval timeout{reply_timeout.count(), 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                writer = std::thread([this]() { write_replies(); });
+            }
+            
+            inference_connection_t(const inference_connection_t&) = delete;
+            
+            inference_connection_t& operator=(const inference_connection_t&) = delete;
+            
+            /**
+             * queues a reply without waiting on the client
+             */
+            void reply(const inference_reply_header_t& header, const Scalar* outputs)
+            {
+                const auto output_bytes = header.output_count * sizeof(Scalar);
+                {
+                    std::scoped_lock lock(mutex);
+                    if (hung_up)
+                        return;
+                    if (pending.size() + sizeof(header) + output_bytes > max_pending_bytes)
+                    {
+                        BLT_WARN("Closing a client that stopped reading its replies");
+                        drop();
+                        return;
+                    }
+                    const auto* bytes = reinterpret_cast<const char*>(&header);
+                    pending.insert(pending.end(), bytes, bytes + sizeof(header));
+                    bytes = reinterpret_cast<const char*>(outputs);
+                    pending.insert(pending.end(), bytes, bytes + output_bytes);
+                }
+                condition.notify_one();
+            }
+            
+            /**
+             * @return true once every reply queued so far has been written, or never will be
+             */
+            [[nodiscard]] bool flushed() const
+            {
+                std::scoped_lock lock(mutex);
+                return hung_up || (pending.empty() && !writing);
+            }
+            
+            /**
+             * wakes up whoever is reading requests from this connection, replies to requests already taken can still be written
+             */
+            void shutdown() const
+            {
+                ::shutdown(fd, SHUT_RD);
+            }
+            
+            [[nodiscard]] int get_fd() const
+            {
+                return fd;
+            }
+            
+            /**
+             * writes whatever is still queued before closing
+             */
+            ~inference_connection_t()
+            {
+                {
+                    std::scoped_lock lock(mutex);
+                    closing = true;
+                }
+                condition.notify_one();
+                writer.join();
+                ::close(fd);
+            }
+        
+        private:
+            void write_replies()
+            {
+                std::vector<char> sending;
+                std::unique_lock lock(mutex);
+                while (true)
+                {
+                    condition.wait(lock, [this]() { return !pending.empty() || closing || hung_up; });
+                    if (hung_up || pending.empty())
+                        return;
+                    sending.swap(pending);
+                    writing = true;
+                    lock.unlock();
+                    bool failed = false;
+                    try
+                    {
+                        write_all(fd, sending.data(), sending.size());
+                    } catch (const std::runtime_error&)
+                    {
+                        // the client went away or took nothing for reply_timeout
+                        failed = true;
+                    }
+                    sending.clear();
+                    lock.lock();
+                    writing = false;
+                    if (failed)
+                        drop();
+                }
+            }
+            
+            // with the lock held, stops reading and writing to the client. everything it is still owed is thrown away
+            void drop()
+            {
+                hung_up = true;
+                pending.clear();
+                ::shutdown(fd, SHUT_RDWR);
+                condition.notify_one();
+            }
+            
+            int fd;
+            mutable std::mutex mutex;
+            std::condition_variable condition;
+            std::vector<char> pending;
+            // the writer has taken replies out of pending and not finished writing them
+            bool writing = false;
+            bool hung_up = false;
+            bool closing = false;
+            std::thread writer;
+    };
+    
+    struct inference_request_t
+    {
+        std::shared_ptr<inference_connection_t> connection;
+        std::uint64_t id;
+        std::vector<Scalar> bins;
+        std::chrono::steady_clock::time_point arrival;
+    };
+    
+    /**
+     * owns one network and coalesces the requests for it into batches. a batch is run as soon as it is full or once its oldest
+     * request has waited for the deadline, whichever comes first, through a single batched forward pass.
+     */
+    class inference_batcher_t
+    {
+        public:
+            inference_batcher_t(network_t& network, blt::size_t input_size, blt::size_t max_batch, std::chrono::microseconds deadline):
+                    network(network), input_size(input_size), max_batch(std::max<blt::size_t>(1, max_batch)), deadline(deadline)
+            {
+                worker = std::thread([this]() { run(); });
+            }
+            
+            inference_batcher_t(const inference_batcher_t&) = delete;
+            
+            inference_batcher_t& operator=(const inference_batcher_t&) = delete;
+            
+            void submit(inference_request_t request)
+            {
+                {
+                    std::scoped_lock lock(mutex);
+                    queue.push_back(std::move(request));
+                }
+                condition.notify_one();
+            }
+            
+            [[nodiscard]] blt::size_t batches() const
+            {
+                std::scoped_lock lock(mutex);
+                return batch_count;
+            }
+            
+            [[nodiscard]] blt::size_t requests() const
+            {
+                std::scoped_lock lock(mutex);
+                return request_count;
+            }
+            
+            /**
+             * waits until everything already submitted has been answered
+             */
+            void drain()
+            {
+                std::unique_lock lock(mutex);
+                idle.wait(lock, [this]() { return queue.empty() && !running; });
+            }
+            
+            /**
+             * answers everything already submitted before returning
+             */
+            ~inference_batcher_t()
+            {
+                {
+                    std::scoped_lock lock(mutex);
+                    done = true;
+                }
+                condition.notify_one();
+                worker.join();
+            }
+        
+        private:
+            void run()
+            {
+                std::vector<inference_request_t> batch;
+                matrix_t input;
+                std::unique_lock lock(mutex);
+                while (true)
+                {
+                    condition.wait(lock, [this]() { return !queue.empty() || done; });
+                    if (queue.empty())
+                        return;
+                    condition.wait_until(lock, queue.front().arrival + deadline, [this]() { return queue.size() >= max_batch || done; });
+                    
+                    const auto count = std::min(queue.size(), max_batch);
+                    batch.clear();
+                    std::move(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(count), std::back_inserter(batch));
+                    queue.erase(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(count));
+                    running = true;
+                    lock.unlock();
+                    
+                    input.resize(static_cast<Eigen::Index>(input_size), static_cast<Eigen::Index>(batch.size()));
+                    for (auto [i, request] : blt::enumerate(batch))
+                        input.col(static_cast<Eigen::Index>(i)) = Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>(
+                                request.bins.data(), static_cast<Eigen::Index>(input_size));
+                    const auto& outputs = network.execute_batch(input);
+                    for (auto [i, request] : blt::enumerate(batch))
+                    {
+                        // the outputs are column-major so each sample's outputs are next to each other
+                        const auto* out = outputs.col(static_cast<Eigen::Index>(i)).data();
+                        const auto out_size = static_cast<blt::size_t>(outputs.rows());
+                        inference_reply_header_t header{request.id, is_thinks_bad(span<const Scalar>{out, out_size}) ? 1 : 0,
+                                                        static_cast<std::uint32_t>(out_size)};
+                        request.connection->reply(header, out);
+                    }
+                    // lets go of the connections, a client can't be released while a batch holds it
+                    const auto answered = batch.size();
+                    batch.clear();
+                    
+                    lock.lock();
+                    batch_count++;
+                    request_count += answered;
+                    running = false;
+                    if (queue.empty())
+                        idle.notify_all();
+                }
+            }
+            
+            network_t& network;
+            blt::size_t input_size;
+            blt::size_t max_batch;
+            std::chrono::microseconds deadline;
+            
+            mutable std::mutex mutex;
+            std::condition_variable condition;
+            std::condition_variable idle;
+            std::deque<inference_request_t> queue;
+            blt::size_t batch_count = 0;
+            blt::size_t request_count = 0;
+            // a batch taken off the queue is being answered
+            bool running = false;
+            bool done = false;
+            std::thread worker;
+    };
+    
+    /**
+     * accepts clients on a unix domain socket and hands their requests to the batcher for the network of their size.
+     * every client gets a thread reading its requests, the batchers queue the replies on its connection which writes them from a
+     * thread of its own. a client is forgotten once it hangs up and the last reply to it has been written.
+     */
+    class inference_server_t
+    {
+        public:
+            /**
+             * starts listening on path, replacing any stale socket file left there
+             */
+            inference_server_t(std::string path, blt::size_t max_batch, std::chrono::microseconds deadline):
+                    path(std::move(path)), max_batch(max_batch), deadline(deadline)
+            {
+                auto address = make_unix_address(this->path);
+                listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (listen_fd < 0)
+                    throw socket_error("Failed to create server socket");
+                unlink_socket(this->path);
+                if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+                    throw socket_error("Failed to bind server socket to '" + this->path + "'");
+                if (::listen(listen_fd, SOMAXCONN) < 0)
+                    throw socket_error("Failed to listen on server socket");
+            }
+            
+            inference_server_t(const inference_server_t&) = delete;
+            
+            inference_server_t& operator=(const inference_server_t&) = delete;
+            
+            /**
+             * serves requests with input_size bins using network, which must outlive the server and not be used elsewhere while it runs
+             */
+            void add_network(blt::size_t input_size, network_t& network)
+            {
+                batchers[input_size] = std::make_unique<inference_batcher_t>(network, input_size, max_batch, deadline);
+                largest_input = std::max(largest_input, input_size);
+            }
+            
+            /**
+             * accepts and serves clients until stop returns true, checked every 100ms, then answers every request already received
+             */
+            template<typename StopFunc>
+            void run(StopFunc&& stop)
+            {
+                // a client hanging up while we write its reply should only fail that write
+                std::signal(SIGPIPE, SIG_IGN);
+                while (!stop())
+                {
+                    pollfd poll_fd{listen_fd, POLLIN, 0};
+                    auto ready = ::poll(&poll_fd, 1, 100);
+                    if (ready < 0 && errno != EINTR)
+                        throw socket_error("Failed to wait for clients");
+                    sweep_clients();
+                    if (ready <= 0)
+                        continue;
+                    auto fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (fd < 0)
+                    {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                            continue;
+                        throw socket_error("Failed to accept client");
+                    }
+                    auto& client = clients.emplace_back();
+                    client.connection = std::make_shared<inference_connection_t>(fd);
+                    client.reader = std::thread([this, &client]() {
+                        serve(client.connection);
+                        client.finished = true;
+                    });
+                }
+                // only the read side is shut down so the requests already submitted can still be answered
+                for (auto& client : clients)
+                    client.connection->shutdown();
+                for (auto& client : clients)
+                    client.reader.join();
+                for (auto& [size, batcher] : batchers)
+                    batcher->drain();
+                clients.clear();
+            }
+            
+            /**
+             * @return the number of batches and requests answered over every network
+             */
+            [[nodiscard]] std::pair<blt::size_t, blt::size_t> totals() const
+            {
+                blt::size_t batches = 0;
+                blt::size_t requests = 0;
+                for (const auto& [size, batcher] : batchers)
+                {
+                    batches += batcher->batches();
+                    requests += batcher->requests();
+                }
+                return {batches, requests};
+            }
+            
+            ~inference_server_t()
+            {
+                // the batchers go first so every queued request is answered before the connections close
+                batchers.clear();
+                if (listen_fd >= 0)
+                    ::close(listen_fd);
+                unlink_socket(path);
+            }
+        
+        private:
+            struct client_t
+            {
+                std::shared_ptr<inference_connection_t> connection;
+                std::thread reader;
+                std::atomic_bool finished = false;
+            };
+            
+            /**
+             * joins the readers of clients that hung up and lets go of their connections once nothing more is owed to them. the
+             * connection is then only held here, so closing it doesn't wait on the client
+             */
+            void sweep_clients()
+            {
+                for (auto it = clients.begin(); it != clients.end();)
+                {
+                    if (it->finished && it->connection.use_count() == 1 && it->connection->flushed())
+                    {
+                        it->reader.join();
+                        it = clients.erase(it);
+                    } else
+                        ++it;
+                }
+            }
+            
+            void serve(const std::shared_ptr<inference_connection_t>& connection)
+            {
+                // bins of requests for sizes without a network are read into here and dropped
+                std::vector<Scalar> discard;
+                try
+                {
+                    while (true)
+                    {
+                        inference_request_header_t header{};
+                        read_all(connection->get_fd(), &header, sizeof(header));
+                        // checked before allocating anything, the size comes from the client
+                        if (header.bin_count > largest_input)
+                        {
+                            BLT_WARN("Closing a client that sent a request with %u bins, the largest network takes %ld", header.bin_count,
+                                     largest_input);
+                            return;
+                        }
+                        
+                        auto batcher = batchers.find(header.bin_count);
+                        if (batcher == batchers.end())
+                        {
+                            discard.resize(header.bin_count);
+                            read_all(connection->get_fd(), discard.data(), discard.size() * sizeof(Scalar));
+                            connection->reply({header.id, -1, 0}, nullptr);
+                            continue;
+                        }
+                        std::vector<Scalar> bins(header.bin_count);
+                        read_all(connection->get_fd(), bins.data(), bins.size() * sizeof(Scalar));
+                        batcher->second->submit({connection, header.id, std::move(bins), std::chrono::steady_clock::now()});
+                    }
+                } catch (const std::runtime_error&)
+                {
+                    // the client hung up or we are shutting down
+                } catch (const std::exception& e)
+                {
+                    BLT_WARN("Closing a client after failing to serve it: %s", e.what());
+                }
+            }
+            
+            std::string path;
+            blt::size_t max_batch;
+            std::chrono::microseconds deadline;
+            int listen_fd = -1;
+            std::unordered_map<blt::size_t, std::unique_ptr<inference_batcher_t>> batchers;
+            blt::size_t largest_input = 0;
+            // a list so a reader can hold onto its client while others are added and removed
+            std::list<client_t> clients;
+    };
+    
+    /**
+     * a blocking connection to an inference_server_t, one request at a time
+     */
+    class inference_client_t
+    {
+        public:
+            struct result_t
+            {
+                // -1 if the server has no network for that many bins
+                blt::i32 verdict;
+                std::vector<Scalar> outputs;
+            };
+            
+            explicit inference_client_t(const std::string& path)
+            {
+                auto address = make_unix_address(path);
+                fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                    throw socket_error("Failed to create client socket");
+                if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+                {
+                    ::close(fd);
+                    throw socket_error("Failed to connect to inference server at '" + path + "'");
+                }
+            }
+            
+            inference_client_t(const inference_client_t&) = delete;
+            
+            inference_client_t& operator=(const inference_client_t&) = delete;
+            
+            result_t classify(span<const Scalar> bins)
+            {
+                inference_request_header_t request{next_id++, static_cast<std::uint32_t>(bins.size()), 0};
+                write_all(fd, &request, sizeof(request));
+                write_all(fd, bins.data(), bins.size() * sizeof(Scalar));
+                inference_reply_header_t reply{};
+                read_all(fd, &reply, sizeof(reply));
+                result_t result{reply.verdict, std::vector<Scalar>(reply.output_count)};
+                read_all(fd, result.outputs.data(), result.outputs.size() * sizeof(Scalar));
+                return result;
+            }
+            
+            ~inference_client_t()
+            {
+                ::close(fd);
+            }
+        
+        private:
+            int fd = -1;
+            std::uint64_t next_id = 0;
+    };
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_SERVER_H
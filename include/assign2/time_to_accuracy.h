@@ -0,0 +1,138 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSC_4P80_ASSIGNMENT_2_TIME_TO_ACCURACY_H
+#define COSC_4P80_ASSIGNMENT_2_TIME_TO_ACCURACY_H
+
+#include <assign2/common.h>
+#include <assign2/network.h>
+#include <assign2/cross_validation.h>
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+namespace assign2
+{
+    /**
+     * when a time to accuracy run stops. a run reaching either target has converged, one that hits max_epochs first has not
+     */
+    struct accuracy_target_t
+    {
+        // percent of the held out fold classified correctly
+        Scalar correct_test = 95;
+        // error on the held out fold, 0 disables
+        Scalar test_error = 0;
+        blt::size_t max_epochs = 10000;
+    };
+    
+    /**
+     * one row of the time to accuracy table
+     */
+    struct time_to_accuracy_t
+    {
+        blt::i32 id;
+        blt::size_t fold;
+        bool reached;
+        blt::size_t epochs;
+        // training samples processed, epochs times the size of the training folds
+        blt::size_t samples;
+        double seconds;
+        Scalar test_error;
+        Scalar correct_test;
+        // of the whole process, in kilobytes
+        blt::size_t peak_rss_kb;
+    };
+    
+    /**
+     * resets the peak resident set size the kernel reports as VmHWM so the next read only covers what happened after this
+     * @return false if this kernel doesn't support it, peak_rss_kb() is then the peak over the life of the process
+     */
+    inline bool reset_peak_rss()
+    {
+        std::ofstream clear_refs{"/proc/self/clear_refs"};
+        return static_cast<bool>(clear_refs << "5") && static_cast<bool>(clear_refs.flush());
+    }
+    
+    inline blt::size_t peak_rss_kb()
+    {
+        std::ifstream status{"/proc/self/status"};
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.rfind("VmHWM:", 0) == 0)
+                return std::stoul(line.substr(6));
+        }
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<blt::size_t>(usage.ru_maxrss);
+    }
+    
+    /**
+     * trains a fresh network on every fold of groups until it reaches target, timing each run from the first epoch to the epoch the
+     * target was checked and met. the held out fold is evaluated after every epoch so that evaluation is part of the time, it is what
+     * finding out when to stop costs. folds run one after another so the times and memory of one don't overlap with another's.
+     * @param create makes the network for a fold, it should seed its initializer the same way every time for the runs to be reproducible
+     * @param batch_size if set train with mini-batches of this size instead of per-sample SGD
+     */
+    template<typename NetworkFactory>
+    std::vector<time_to_accuracy_t> time_to_accuracy(blt::i32 id, const std::vector<data_file_t>& groups, NetworkFactory&& create,
+                                                     const accuracy_target_t& target, std::optional<blt::size_t> batch_size = {})
+    {
+        std::vector<time_to_accuracy_t> results;
+        for (blt::size_t k = 0; k < groups.size(); k++)
+        {
+            const auto [training, testing] = make_fold(groups, k);
+            auto network = create();
+            
+            reset_peak_rss();
+            time_to_accuracy_t result{id, k, false, 0, 0, 0, 0, 0, 0};
+            const auto start = std::chrono::steady_clock::now();
+            while (!result.reached && result.epochs < target.max_epochs)
+            {
+                if (batch_size)
+                    network.train_batch(training.data_points, *batch_size);
+                else
+                    network.train_epoch(training);
+                result.epochs++;
+                result.samples += training.data_points.size();
+                
+                result.test_error = network.error(testing).error;
+                result.correct_test = network.percent_correct(testing);
+                result.reached = result.correct_test >= target.correct_test || (target.test_error > 0 && result.test_error <= target.test_error);
+            }
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            result.peak_rss_kb = peak_rss_kb();
+            results.push_back(result);
+        }
+        return results;
+    }
+    
+    inline void save_time_to_accuracy(const std::string& file, const std::vector<time_to_accuracy_t>& results)
+    {
+        std::ofstream stream{file};
+        stream << "size,fold,reached,epochs,samples,seconds,test_error,correct_test,peak_rss_kb\n";
+        for (const auto& r : results)
+            stream << r.id << ',' << r.fold << ',' << r.reached << ',' << r.epochs << ',' << r.samples << ',' << r.seconds << ','
+                   << r.test_error << ',' << r.correct_test << ',' << r.peak_rss_kb << '\n';
+    }
+}
+
+#endif //COSC_4P80_ASSIGNMENT_2_TIME_TO_ACCURACY_H
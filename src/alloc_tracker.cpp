@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <assign2/alloc_tracker.h>
+
+#ifdef ASSIGN2_TRACK_ALLOCATIONS
+    
+    #include <cerrno>
+    #include <cstdlib>
+    #include <new>
+
+void* operator new(std::size_t size)
+{
+    ++assign2::allocation_count;
+    if (auto ptr = std::malloc(size == 0 ? 1 : size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+    ++assign2::allocation_count;
+    const auto alignment = static_cast<std::size_t>(align);
+    // aligned_alloc wants the size to be a non-zero multiple of the alignment
+    const auto rounded = size == 0 ? alignment : (size + alignment - 1) / alignment * alignment;
+    if (auto ptr = std::aligned_alloc(alignment, rounded))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+/*
+ * Eigen (its GEMM blocking buffers and temporaries) and C code allocate through malloc rather than operator new. glibc lets the
+ * program replace malloc, these count the allocation and hand it to glibc's own. free is left to glibc. the sanitizers replace
+ * malloc themselves, so under them only operator new is counted. a new that goes through here counts twice, only whether the
+ * count moved matters.
+ */
+    #if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+
+extern "C"
+{
+    void* __libc_malloc(std::size_t size);
+    void* __libc_calloc(std::size_t count, std::size_t size);
+    void* __libc_realloc(void* ptr, std::size_t size);
+    void* __libc_memalign(std::size_t alignment, std::size_t size);
+    
+    void* malloc(std::size_t size)
+    {
+        ++assign2::allocation_count;
+        return __libc_malloc(size);
+    }
+    
+    void* calloc(std::size_t count, std::size_t size)
+    {
+        ++assign2::allocation_count;
+        return __libc_calloc(count, size);
+    }
+    
+    void* realloc(void* ptr, std::size_t size)
+    {
+        ++assign2::allocation_count;
+        return __libc_realloc(ptr, size);
+    }
+    
+    void* memalign(std::size_t alignment, std::size_t size)
+    {
+        ++assign2::allocation_count;
+        return __libc_memalign(alignment, size);
+    }
+    
+    void* aligned_alloc(std::size_t alignment, std::size_t size)
+    {
+        ++assign2::allocation_count;
+        return __libc_memalign(alignment, size);
+    }
+    
+    int posix_memalign(void** out, std::size_t alignment, std::size_t size)
+    {
+        if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+            return EINVAL;
+        ++assign2::allocation_count;
+        auto ptr = __libc_memalign(alignment, size);
+        if (ptr == nullptr && size != 0)
+            return ENOMEM;
+        *out = ptr;
+        return 0;
+    }
+}
+
+    #endif
+
+#endif
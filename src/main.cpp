@@ -2,15 +2,31 @@
 #include <blt/fs/loader.h>
 #include <blt/parse/argparse.h>
 #include <assign2/common.h>
+#include <assign2/dataset.h>
+#include <assign2/features.h>
+#include <assign2/monitor.h>
 #include <filesystem>
 #include "blt/iterator/enumerate.h"
 #include <assign2/layer.h>
 #include <assign2/functions.h>
 #include <assign2/network.h>
+#include <assign2/cross_validation.h>
+#include <assign2/scheduler.h>
+#include <assign2/hogwild.h>
+#include <assign2/data_parallel.h>
+#include <assign2/distributed.h>
+#include <assign2/model.h>
+#include <assign2/server.h>
+#include <assign2/quantize.h>
+#include <assign2/precision.h>
+#include <assign2/time_to_accuracy.h>
 #include <memory>
 #include <thread>
 #include <algorithm>
 #include <mutex>
+#include <optional>
+#include <sys/wait.h>
+#include <csignal>
 
 using namespace assign2;
 
@@ -18,7 +34,24 @@ std::vector<data_file_t> data_files;
 blt::hashmap_t<blt::i32, std::vector<data_file_t>> groups;
 blt::hashmap_t<blt::i32, network_t> networks;
 bool with_momentum = false;
+// if set the headless run uses mini-batches of this size instead of per-sample SGD
+std::optional<blt::size_t> batch_size;
 Scalar omega = 0.001;
+// set by SIGINT to stop following a growing file in --monitor or to stop --serve
+volatile std::sig_atomic_t stop_requested = false;
+
+/**
+ * makes SIGINT set stop_requested. without SA_RESTART a blocking call returns EINTR when interrupted, so whatever is waiting
+ * sees the request right away instead of once it next wakes up
+ */
+void stop_on_interrupt()
+{
+    struct sigaction action{};
+    action.sa_handler = [](int) { stop_requested = true; };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(SIGINT, &action, nullptr);
+}
 
 random_init randomizer{std::random_device{}()};
 empty_init empty;
@@ -32,11 +65,12 @@ network_t create_network(blt::i32 input, blt::i32 hidden)
 {
     const auto mul = 0.5;
     const auto inner_mul = 0.25;
-    auto layer1 = std::make_unique<layer_t>(input, hidden * mul, &sig, randomizer, empty);
-    auto layer2 = std::make_unique<layer_t>(hidden * mul, hidden * inner_mul, &sig, randomizer, empty);
-//    auto layer3 = std::make_unique<layer_t>(hidden * inner_mul, hidden * inner_mul, &sig, randomizer, empty);
-//    auto layer4 = std::make_unique<layer_t>(hidden * inner_mul, hidden * inner_mul, &sig, randomizer, empty);
-    auto layer_output = std::make_unique<layer_t>(hidden * inner_mul, 2, &sig, randomizer, empty);
+    // passing the activation by value lets the layers compile against sigmoid_function directly, &sig would go through function_t
+    auto layer1 = std::make_unique<layer_t>(input, hidden * mul, sig, randomizer, empty);
+    auto layer2 = std::make_unique<layer_t>(hidden * mul, hidden * inner_mul, sig, randomizer, empty);
+//    auto layer3 = std::make_unique<layer_t>(hidden * inner_mul, hidden * inner_mul, sig, randomizer, empty);
+//    auto layer4 = std::make_unique<layer_t>(hidden * inner_mul, hidden * inner_mul, sig, randomizer, empty);
+    auto layer_output = std::make_unique<layer_t>(hidden * inner_mul, 2, sig, randomizer, empty);
     
     std::vector<std::unique_ptr<layer_t>> vec;
     vec.push_back(std::move(layer1));
@@ -51,23 +85,27 @@ network_t create_network(blt::i32 input, blt::i32 hidden)
     return network;
 }
 
-std::pair<data_file_t, data_file_t> create_groups(blt::i32 network, blt::i32 k = 0)
+/**
+ * @return microseconds per sample running data through net, timing enough passes to get past the clock's resolution
+ */
+template<typename Network>
+double time_per_sample(Network& net, const data_file_t& data)
 {
-    data_file_t training;
-    data_file_t testing;
-    
-    testing.data_points.insert(testing.data_points.begin(),
-                               (groups[network].begin() + k)->data_points.begin(),
-                               (groups[network].begin() + k)->data_points.end());
-    
-    for (auto [i, a] : blt::enumerate(groups[network]))
+    blt::size_t samples = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto now = start;
+    for (; now - start < std::chrono::milliseconds(200); now = std::chrono::steady_clock::now())
     {
-        if (i == static_cast<blt::size_t>(k))
-            continue;
-        training.data_points.insert(training.data_points.begin(), a.data_points.begin(), a.data_points.end());
+        for (const auto& d : data.data_points)
+            net.execute(d.bins);
+        samples += data.data_points.size();
     }
-    
-    return {training, testing};
+    return std::chrono::duration<double, std::micro>(now - start).count() / static_cast<double>(samples);
+}
+
+std::pair<data_file_t, data_file_t> create_groups(blt::i32 network, blt::i32 k = 0)
+{
+    return make_fold(groups[network], k);
 }
 
 #ifdef BLT_USE_GRAPHICS
@@ -178,13 +216,14 @@ void init(const blt::gfx::window_data&)
                     errors_over_time.push_back(error.error);
                     error_derivative_over_time.push_back(error.d_error);
                     
+                    ASSIGN2_PROFILE_SCOPE("evaluate");
                     auto error_test = networks.at(run_epoch).error(current_testing);
                     error_of_test.push_back(error_test.error);
                     error_of_test_derivative.push_back(error_test.d_error);
                     
                     for (auto& d : current_testing.data_points)
                     {
-                        auto out = networks.at(run_epoch).execute(d.bins);
+                        const auto& out = networks.at(run_epoch).execute(d.bins);
                         auto is_bad = is_thinks_bad(out);
                         
                         if ((is_bad && d.is_bad) || (!is_bad && !d.is_bad))
@@ -195,7 +234,7 @@ void init(const blt::gfx::window_data&)
                     
                     for (auto& d : current_training.data_points)
                     {
-                        auto out = networks.at(run_epoch).execute(d.bins);
+                        const auto& out = networks.at(run_epoch).execute(d.bins);
                         auto is_bad = is_thinks_bad(out);
                         
                         if ((is_bad && d.is_bad) || (!is_bad && !d.is_bad))
@@ -356,7 +395,7 @@ void update(const blt::gfx::window_data& data)
             for (auto& d : current_testing.data_points)
             {
                 std::cout << "Good or bad? " << (d.is_bad ? "Bad" : "Good") << " :: ";
-                auto out = net->second.execute(d.bins);
+                const auto& out = net->second.execute(d.bins);
                 auto is_bad = is_thinks_bad(out);
                 
                 if ((is_bad && d.is_bad) || (!is_bad && !d.is_bad))
@@ -500,65 +539,150 @@ int main(int argc, const char** argv)
                                              .setAction(blt::arg_action_t::STORE).setNArgs('?').setConst("3").setMetavar("GROUPS").build());
     parser.addArgument(blt::arg_builder("-m", "--momentum").setHelp("Use momentum in weight calculations").setAction(blt::arg_action_t::STORE_TRUE)
                                                            .setDefault(false).build());
+    parser.addArgument(blt::arg_builder("-b", "--batch").setHelp("Train using mini-batches of SIZE instead of per-sample SGD [0 uses the entire file]")
+                                                        .setMetavar("SIZE").build());
+    parser.addArgument(blt::arg_builder("--validate").setHelp("Run a headless cross-validation of every network, training all folds in parallel")
+                                                      .setAction(blt::arg_action_t::STORE_TRUE).setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--hogwild").setHelp("Train each network with lock-free asynchronous SGD spread over every thread")
+                                                     .setAction(blt::arg_action_t::STORE_TRUE).setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--sync").setHelp("Train each network with synchronous data-parallel mini-batches (see --batch) "
+                                                          "spread over every thread, reproducible for a given seed and thread count")
+                                                 .setAction(blt::arg_action_t::STORE_TRUE).setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--workers").setHelp("Train with this many processes averaging their parameters through a coordinator. "
+                                                             "Without --worker or --coordinator every process is forked locally")
+                                                    .setMetavar("COUNT").build());
+    parser.addArgument(blt::arg_builder("--worker").setHelp("Only run as the worker with this rank, requires the same --seed on every process")
+                                                   .setMetavar("RANK").build());
+    parser.addArgument(blt::arg_builder("--coordinator").setHelp("Only run the coordinator").setAction(blt::arg_action_t::STORE_TRUE)
+                                                        .setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--socket").setHelp("Unix socket the coordinator listens on").setDefault("/tmp/assign2.sock")
+                                                   .setMetavar("PATH").build());
+    parser.addArgument(blt::arg_builder("--average-every").setHelp("Epochs each worker trains between parameter averages").setDefault("1")
+                                                          .setMetavar("EPOCHS").build());
+    parser.addArgument(blt::arg_builder("--signals").setHelp("Compute the FFT bins from the raw .sig recordings in DIRECTORY instead of "
+                                                             "loading .out files")
+                                                    .setMetavar("DIRECTORY").build());
+    parser.addArgument(blt::arg_builder("--monitor").setHelp("After training, monitor the samples streamed from SOURCE (a file, FIFO or - for "
+                                                             "stdin) and print a decision every hop")
+                                                    .setMetavar("SOURCE").build());
+    parser.addArgument(blt::arg_builder("--monitor-size").setHelp("Which network to monitor with").setDefault("64").setMetavar("BINS").build());
+    parser.addArgument(blt::arg_builder("--spectrum-bins").setHelp("Resolution the streamed spectrum is computed at before being reduced")
+                                                          .setDefault("1000").setMetavar("BINS").build());
+    parser.addArgument(blt::arg_builder("--hop").setHelp("Samples between monitored windows [Defaults to the window size]").setDefault("0")
+                                                .setMetavar("SAMPLES").build());
+    parser.addArgument(blt::arg_builder("--budget").setHelp("Per window latency budget in microseconds").setDefault("1000")
+                                                   .setMetavar("US").build());
+    parser.addArgument(blt::arg_builder("--save-models").setHelp("Write each network to DIRECTORY/network<size>.model after training")
+                                                        .setMetavar("DIRECTORY").build());
+    parser.addArgument(blt::arg_builder("--load-models").setHelp("Start from the networks saved in DIRECTORY by --save-models where one exists "
+                                                                 "[Use -e 0 to only run inference]")
+                                                        .setMetavar("DIRECTORY").build());
+    parser.addArgument(blt::arg_builder("--serve").setHelp("After training, answer classification requests on the unix socket PATH until "
+                                                           "interrupted (see server.h for the protocol)")
+                                                  .setMetavar("PATH").build());
+    parser.addArgument(blt::arg_builder("--max-batch").setHelp("Most requests --serve runs through a network at once").setDefault("64")
+                                                      .setMetavar("REQUESTS").build());
+    parser.addArgument(blt::arg_builder("--deadline").setHelp("Longest --serve holds a request while filling its batch, in microseconds")
+                                                     .setDefault("1000").setMetavar("US").build());
+    parser.addArgument(blt::arg_builder("--quantize").setHelp("After training, quantize each network to int8 (calibrated on two thirds of its "
+                                                              "data) and report the accuracy and speed against the float network on the "
+                                                              "other third")
+                                                     .setAction(blt::arg_action_t::STORE_TRUE).setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--precision").setHelp("After training, run each network with fp16, bf16 and fp64 weights and report "
+                                                               "the accuracy and speed against float")
+                                                      .setAction(blt::arg_action_t::STORE_TRUE).setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--time-to-accuracy").setHelp("Time how long each network takes to reach the target on every k-fold "
+                                                                      "(-k, 3 by default) with a fixed seed (-s) and write the table to FILE")
+                                                             .setMetavar("FILE").build());
+    parser.addArgument(blt::arg_builder("--target-accuracy").setHelp("Percent correct on the held out fold --time-to-accuracy trains to")
+                                                            .setDefault("95").setMetavar("PERCENT").build());
+    parser.addArgument(blt::arg_builder("--target-error").setHelp("Error on the held out fold --time-to-accuracy trains to [0 disables]")
+                                                         .setDefault("0").setMetavar("ERROR").build());
+    parser.addArgument(blt::arg_builder("--checkpoint").setHelp("Checkpoint each network into DIRECTORY in the background while training")
+                                                       .setMetavar("DIRECTORY").build());
+    parser.addArgument(blt::arg_builder("--checkpoint-every").setHelp("Epochs between checkpoints [0 disables]").setDefault("100")
+                                                             .setMetavar("EPOCHS").build());
+    parser.addArgument(blt::arg_builder("--checkpoint-seconds").setHelp("Seconds between checkpoints [0 disables]").setDefault("0")
+                                                               .setMetavar("SECONDS").build());
+    parser.addArgument(blt::arg_builder("--resume").setHelp("Continue each network from its checkpoint in the --checkpoint directory")
+                                                   .setAction(blt::arg_action_t::STORE_TRUE).setDefault(false).build());
+    parser.addArgument(blt::arg_builder("--profile").setHelp("Time the phases of startup and training, writing PREFIX.trace.json (Chrome trace "
+                                                             "events) and PREFIX_histograms.csv on exit [Needs ENABLE_PROFILING]")
+                                                    .setMetavar("PREFIX").build());
+    parser.addArgument(blt::arg_builder("--profile-events").setHelp("Trace events kept per thread by --profile, the histograms count past it")
+                                                           .setDefault("262144").setMetavar("EVENTS").build());
+    parser.addArgument(blt::arg_builder("-s", "--seed").setHelp("Seed used to initialize the weights and split the k-folds "
+                                                                "[Defaults to a random seed]")
+                                                       .setMetavar("SEED").build());
+    parser.addArgument(blt::arg_builder("-e", "--epochs").setHelp("Number of epochs to train for when running headless").setDefault("10000")
+                                                         .setMetavar("EPOCHS").build());
+    parser.addArgument(blt::arg_builder("-t", "--threads").setHelp("Number of threads to train with [Defaults to the number of cores]")
+                                                          .setDefault(std::to_string(default_thread_count())).setMetavar("THREADS").build());
     
     auto args = parser.parse_args(argc, argv);
+    
+    // written when main returns, whichever mode ran
+    struct profile_output_t
+    {
+        std::string prefix;
+        
+        ~profile_output_t()
+        {
+#ifdef ASSIGN2_PROFILING
+            if (prefix.empty())
+                return;
+            profiler().stop();
+            profiler().write_chrome_trace(prefix + ".trace.json");
+            profiler().write_histograms(prefix + "_histograms.csv");
+            BLT_INFO("Wrote profile to '%s.trace.json' and '%s_histograms.csv'", prefix.c_str(), prefix.c_str());
+#endif
+        }
+    } profile_output;
+    if (args.contains("profile"))
+    {
+#ifdef ASSIGN2_PROFILING
+        profile_output.prefix = args.get<std::string>("profile");
+        profiler().start(std::stoul(args.get<std::string>("profile-events")), std::stoul(args.get<std::string>("threads")));
+#else
+        BLT_WARN("--profile does nothing, build with ENABLE_PROFILING to include the profiler");
+#endif
+    }
+    
+    if (args.contains("seed"))
+        randomizer = random_init{std::stoul(args.get<std::string>("seed"))};
+    BLT_INFO("Using %s kernels", kernels().name);
     if (args.get<bool>("momentum"))
     {
         BLT_INFO("Using Momentum");
         with_momentum = true;
     }
+    if (args.contains("batch"))
+    {
+        batch_size = std::stoul(args.get<std::string>("batch"));
+        BLT_INFO("Using mini-batches of size %ld", *batch_size);
+    }
     
-    std::string data_directory = blt::string::ensure_ends_with_path_separator(args.get<std::string>("file"));
-    
-    data_files = load_data_files(get_data_files(data_directory));
+    if (args.contains("signals"))
+    {
+        auto recordings = load_recordings(args.get<std::string>("signals"));
+        BLT_INFO("Extracting features from %ld recordings", recordings.size());
+        data_files = extract_features(recordings, default_bin_counts, std::stoul(args.get<std::string>("threads")));
+        data_files.erase(std::remove_if(data_files.begin(), data_files.end(), [](const data_file_t& f) {
+            return f.data_points.empty();
+        }), data_files.end());
+    } else
+    {
+        std::string data_directory = blt::string::ensure_ends_with_path_separator(args.get<std::string>("file"));
+        data_files = load_data_files(get_data_files(data_directory));
+    }
     
     if (args.contains("kfold"))
     {
         auto kfold = std::stoul(args.get<std::string>("kfold"));
         BLT_INFO("Running K-Fold-%ld", kfold);
-        blt::random::random_t rand(std::random_device{}());
+        blt::random::random_t rand(args.contains("seed") ? std::stoul(args.get<std::string>("seed")) : std::random_device{}());
         for (auto& n : data_files)
-        {
-            std::vector<data_t> goods;
-            // Big Airship of Doom (BAD)
-            std::vector<data_t> bads;
-            
-            for (auto& p : n.data_points)
-            {
-                if (p.is_bad)
-                    bads.push_back(p);
-                else
-                    goods.push_back(p);
-            }
-            
-            // can randomize the order of good and bad inputs
-            std::shuffle(goods.begin(), goods.end(), rand);
-            std::shuffle(bads.begin(), bads.end(), rand);
-            
-            auto size = static_cast<blt::i32>(n.data_points.begin()->bins.size());
-            groups[size] = {};
-            for (blt::size_t i = 0; i < kfold; i++)
-                groups[size].emplace_back();
-            
-            // then copy proportionally into the groups, creating roughly equal groups of data.
-            // my previous setup randomly selected the group index
-            // this resulted in wildly uneven groups, if you got unlucky.
-            // 25 vs 13 in some groups
-            // not sure if this is what we want, but it felt like this would create issues
-            blt::size_t select = 0;
-            for (auto& v : goods)
-            {
-                ++select %= kfold;
-                groups[size][select].data_points.push_back(v);
-            }
-            
-            // because bad motors are in a separate step they are still proportional
-            for (auto& v : bads)
-            {
-                ++select %= kfold;
-                groups[size][select].data_points.push_back(v);
-            }
-        }
+            groups[static_cast<blt::i32>(n.data_points.begin()->bins.size())] = make_groups(n, kfold, rand);
     } else
     {
         for (auto& n : data_files)
@@ -585,6 +709,83 @@ int main(int argc, const char** argv)
         networks[input] = create_network(input, hidden);
     }
     
+    if (args.contains("load-models"))
+    {
+        auto directory = blt::string::ensure_ends_with_path_separator(args.get<std::string>("load-models"));
+        for (auto& [size, network] : networks)
+        {
+            auto path = directory + "network" + std::to_string(size) + ".model";
+            if (!std::filesystem::exists(path))
+                continue;
+            BLT_INFO("Loading network %d from '%s'", size, path.c_str());
+            network = load_model(path);
+            if (with_momentum)
+                network.with_momentum(&omega);
+        }
+    }
+    
+    auto epoch_count = std::stoul(args.get<std::string>("epochs"));
+    auto threads = std::stoul(args.get<std::string>("threads"));
+    
+    if (args.get<bool>("validate"))
+    {
+        for (const auto& [size, g] : groups)
+        {
+            BLT_INFO("Cross validating size %d over %ld folds for %ld epochs on %ld threads", size, g.size(), epoch_count, threads);
+            auto result = cross_validate(g, [size = size]() {
+                layer_id_counter = 0;
+                return create_network(size, size);
+            }, epoch_count, threads, batch_size);
+            for (auto [k, fold] : blt::enumerate(result.folds))
+            {
+                // with no epochs there is nothing to report, the CSVs are still written with just their headers
+                if (epoch_count > 0)
+                    BLT_INFO("\tFold %ld: test error %f, %f%% correct on test", k, fold.test_error.back(), fold.correct_test.back());
+                fold.save(std::to_string(size) + "_" + std::to_string(k));
+            }
+            if (epoch_count > 0)
+                BLT_INFO("\tMean: test error %f, %f%% correct on test", result.mean.test_error.back(), result.mean.correct_test.back());
+            result.mean.save(std::to_string(size) + "_mean");
+        }
+        return 0;
+    }
+    
+    if (args.contains("time-to-accuracy"))
+    {
+        // everything random is seeded so two runs of the same commit only differ in their times
+        const auto seed = args.contains("seed") ? std::stoul(args.get<std::string>("seed")) : 0ul;
+        const auto kfold = args.contains("kfold") ? std::stoul(args.get<std::string>("kfold")) : 3ul;
+        accuracy_target_t target{std::stof(args.get<std::string>("target-accuracy")), std::stof(args.get<std::string>("target-error")),
+                                 epoch_count};
+        
+        std::vector<const data_file_t*> files;
+        for (const auto& f : data_files)
+            files.push_back(&f);
+        std::sort(files.begin(), files.end(), [](const data_file_t* a, const data_file_t* b) {
+            return a->data_points.begin()->bins.size() < b->data_points.begin()->bins.size();
+        });
+        
+        std::vector<time_to_accuracy_t> results;
+        for (const auto* f : files)
+        {
+            auto size = static_cast<blt::i32>(f->data_points.begin()->bins.size());
+            blt::random::random_t rand(seed);
+            BLT_INFO("Timing size %d to %f%% correct over %ld folds, at most %ld epochs", size, target.correct_test, kfold, epoch_count);
+            for (const auto& r : time_to_accuracy(size, make_groups(*f, kfold, rand), [size, seed]() {
+                randomizer = random_init{seed};
+                layer_id_counter = 0;
+                return create_network(size, size);
+            }, target, batch_size))
+            {
+                BLT_INFO("\tFold %ld: %s after %ld epochs (%ld samples) in %fs, %f%% correct, peak RSS %ldkb", r.fold,
+                         r.reached ? "reached" : "not reached", r.epochs, r.samples, r.seconds, r.correct_test, r.peak_rss_kb);
+                results.push_back(r);
+            }
+        }
+        save_time_to_accuracy(args.get<std::string>("time-to-accuracy"), results);
+        return 0;
+    }
+    
     // this is to prevent threading issues due to expanding buffers.
     errors_over_time.reserve(25000);
     error_derivative_over_time.reserve(25000);
@@ -592,7 +793,7 @@ int main(int argc, const char** argv)
     correct_over_time_test.reserve(25000);
     error_of_test.reserve(25000);
     error_of_test_derivative.reserve(25000);
-
+    
 #ifdef BLT_USE_GRAPHICS
     blt::gfx::init(blt::gfx::window_data{"Freeplay Graphics", init, update, 1440, 720}.setSyncInterval(1).setMonitor(glfwGetPrimaryMonitor())
                                                                                       .setMaximized(true));
@@ -600,32 +801,153 @@ int main(int argc, const char** argv)
     return 0;
 #endif
     
-    for (auto f : data_files)
+    if (args.get<bool>("hogwild"))
     {
-        int input = static_cast<int>(f.data_points.begin()->bins.size());
-        int hidden = input;
+        for (const auto& f : data_files)
+        {
+            int input = static_cast<int>(f.data_points.begin()->bins.size());
+            auto& network = networks[input];
+            hogwild_trainer_t trainer{network, threads};
+            
+            BLT_INFO("Hogwild training size %d for %ld epochs on %ld threads", input, epoch_count, threads);
+            error_data_t error{0, 0};
+            for (blt::size_t i = 0; i < epoch_count; i++)
+                error = trainer.train_epoch(f);
+            BLT_INFO("\tFinal error %f, %f%% correct", error.error, network.percent_correct(f));
+        }
+        return 0;
+    }
+    
+    if (args.get<bool>("sync"))
+    {
+        for (const auto& f : data_files)
+        {
+            int input = static_cast<int>(f.data_points.begin()->bins.size());
+            auto& network = networks[input];
+            data_parallel_trainer_t trainer{network, threads};
+            
+            BLT_INFO("Data-parallel training size %d for %ld epochs on %ld threads", input, epoch_count, threads);
+            error_data_t error{0, 0};
+            for (blt::size_t i = 0; i < epoch_count; i++)
+                error = trainer.train_epoch(f, batch_size.value_or(0));
+            BLT_INFO("\tFinal error %.9g, %f%% correct", error.error, network.percent_correct(f));
+        }
+        return 0;
+    }
+    
+    if (args.contains("workers"))
+    {
+        auto worker_count = std::stoul(args.get<std::string>("workers"));
+        auto socket_path = args.get<std::string>("socket");
+        auto average_every = std::max(1ul, std::stoul(args.get<std::string>("average-every")));
         
-        if (input != 64)
-            continue;
+        auto run_worker = [&](blt::size_t rank) {
+            worker_t worker{socket_path};
+            std::vector<blt::i32> sizes;
+            for (const auto& f : data_files)
+                sizes.push_back(static_cast<blt::i32>(f.data_points.begin()->bins.size()));
+            // every worker has to average the networks in the same order
+            std::sort(sizes.begin(), sizes.end());
+            for (auto size : sizes)
+            {
+                const auto& file = *std::find_if(data_files.begin(), data_files.end(), [size](const data_file_t& f) {
+                    return static_cast<blt::i32>(f.data_points.begin()->bins.size()) == size;
+                });
+                auto shard = make_shard(file, rank, worker_count);
+                auto& network = networks[size];
+                for (blt::size_t i = 0; i < epoch_count; i++)
+                {
+                    if (!shard.data_points.empty())
+                        network.train_epoch(shard);
+                    if ((i + 1) % average_every == 0 || i + 1 == epoch_count)
+                        worker.average(network);
+                }
+                if (rank == 0)
+                    BLT_INFO("Distributed training of size %d finished, %f%% correct", size, network.percent_correct(file));
+            }
+            worker.finish();
+            
+            // the last epoch always ends with an average so every worker holds the same networks, only one needs to write them
+            if (rank == 0 && args.contains("save-models"))
+            {
+                auto directory = args.get<std::string>("save-models");
+                std::filesystem::create_directories(directory);
+                directory = blt::string::ensure_ends_with_path_separator(directory);
+                for (auto size : sizes)
+                    save_model(networks[size], directory + "network" + std::to_string(size) + ".model");
+                BLT_INFO("Saved %ld averaged networks to '%s'", sizes.size(), directory.c_str());
+            }
+        };
         
+        if (args.contains("worker"))
+        {
+            run_worker(std::stoul(args.get<std::string>("worker")));
+            return 0;
+        }
+        
+        coordinator_t coordinator{socket_path, worker_count};
+        if (!args.get<bool>("coordinator"))
+        {
+            // local stand in for a cluster, the networks were made before forking so every worker starts from the same weights
+            for (blt::size_t rank = 0; rank < worker_count; rank++)
+            {
+                auto pid = fork();
+                BLT_ASSERT_MSG(pid >= 0, "Failed to fork worker");
+                if (pid == 0)
+                {
+                    // the worker connects through the socket like any other, it has no use for the listening end
+                    coordinator.close_listener();
+                    run_worker(rank);
+                    std::exit(0);
+                }
+            }
+        }
+        int status = 0;
+        try
+        {
+            auto rounds = coordinator.run();
+            BLT_INFO("Coordinator averaged %ld rounds over %ld workers", rounds, worker_count);
+        } catch (const std::runtime_error& e)
+        {
+            // a worker went away in the middle of a round
+            BLT_ERROR("Distributed training failed: %s", e.what());
+            status = 1;
+        }
+        while (wait(nullptr) > 0);
+        return status;
+    }
+    
+    std::vector<training_job_t> jobs;
+    for (const auto& f : data_files)
+    {
+        int input = static_cast<int>(f.data_points.begin()->bins.size());
+        jobs.push_back({input, &networks[input], &f, &f});
+    }
+    
+    std::optional<checkpoint_options_t> checkpoints;
+    if (args.contains("checkpoint"))
+    {
+        checkpoints = checkpoint_options_t{args.get<std::string>("checkpoint"), std::stoul(args.get<std::string>("checkpoint-every")),
+                                           std::stoul(args.get<std::string>("checkpoint-seconds")), args.get<bool>("resume")};
+        std::filesystem::create_directories(checkpoints->directory);
+    } else
+        BLT_ASSERT_MSG(!args.get<bool>("resume"), "--resume needs the --checkpoint directory to resume from");
+    
+    BLT_INFO("Training %ld networks for %ld epochs on %ld threads", jobs.size(), epoch_count, threads);
+    train_all(jobs, epoch_count, threads, batch_size, checkpoints);
+    
+    for (auto& job : jobs)
+    {
         BLT_INFO("-----------------");
-        BLT_INFO("Running for size %d", input);
-        BLT_INFO("With hidden layers %d", input);
+        BLT_INFO("Results for size %d", job.id);
         BLT_INFO("-----------------");
         
-        network_t network = create_network(input, hidden);
-        
-        float o = 0.00001;
-//        network.with_momentum(&o);
-        for (blt::size_t i = 0; i < 10000; i++)
-            network.train_epoch(f, 1);
-        
         BLT_INFO("Test Cases:");
         blt::size_t right = 0;
         blt::size_t wrong = 0;
-        for (auto& d : f.data_points)
+        for (auto& d : job.testing->data_points)
         {
-            auto out = network.execute(d.bins);
+            const auto& out = job.network->execute(d.bins);
             auto is_bad = is_thinks_bad(out);
             
             if ((is_bad && d.is_bad) || (!is_bad && !d.is_bad))
@@ -638,6 +960,107 @@ int main(int argc, const char** argv)
             print_vec(out) << "]" << std::endl;
         }
         BLT_INFO("NN got %ld right and %ld wrong (%%%lf)", right, wrong, static_cast<double>(right) / static_cast<double>(right + wrong) * 100);
+        job.metrics.save(std::to_string(job.id));
+    }
+    
+    if (args.get<bool>("quantize"))
+    {
+        BLT_INFO("Using %s int8 kernels", int8_kernels().name);
+        // calibrated on two thirds of each file and compared on the third it didn't see. the float networks trained on all of it, so
+        // this shows what quantizing costs on inputs outside the calibrated ranges, not how well either network generalizes
+        constexpr blt::size_t quantize_groups = 3;
+        blt::random::random_t rand(args.contains("seed") ? std::stoul(args.get<std::string>("seed")) : std::random_device{}());
+        for (auto& job : jobs)
+        {
+            const auto [calibration, held_out] = make_fold(make_groups(*job.training, quantize_groups, rand), 0);
+            auto quantized = quantize_network(*job.network, calibration);
+            const auto float_correct = job.network->percent_correct(held_out);
+            const auto int8_correct = quantized.percent_correct(held_out);
+            
+            const auto float_us = time_per_sample(*job.network, held_out);
+            const auto int8_us = time_per_sample(quantized, held_out);
+            
+            BLT_INFO("Size %d: on %ld held out points float %f%% correct, int8 %f%% correct (%+f), %.2fus vs %.2fus per sample, "
+                     "%ld weight bytes", job.id, held_out.data_points.size(), float_correct, int8_correct, int8_correct - float_correct,
+                     float_us, int8_us, quantized.weight_bytes());
+        }
+    }
+    
+    if (args.get<bool>("precision"))
+    {
+        BLT_INFO("Using %s half precision kernels", half_kernels().name);
+        for (auto& job : jobs)
+        {
+            fp16_network_t fp16{*job.network};
+            bf16_network_t bf16{*job.network};
+            fp64_network_t fp64{*job.network};
+            
+            // how far float drifts from the fp64 reference
+            double largest_difference = 0;
+            for (const auto& d : job.testing->data_points)
+            {
+                const auto& reference = fp64.execute(d.bins);
+                for (auto [out, ref] : blt::in_pairs(job.network->execute(d.bins), reference))
+                    largest_difference = std::max(largest_difference, std::abs(static_cast<double>(out) - ref));
+            }
+            
+            BLT_INFO("Size %d: float %f%% correct in %.2fus per sample, largest output difference from fp64 %g", job.id,
+                     job.network->percent_correct(*job.testing), time_per_sample(*job.network, *job.testing), largest_difference);
+            BLT_INFO("\tfp16 %f%% correct in %.2fus, bf16 %f%% correct in %.2fus (%f%% with bf16 data), %ld weight bytes",
+                     fp16.percent_correct(*job.testing), time_per_sample(fp16, *job.testing), bf16.percent_correct(*job.testing),
+                     time_per_sample(bf16, *job.testing), bf16.percent_correct(convert_data_file<Eigen::bfloat16>(*job.testing)),
+                     fp16.weight_bytes());
+        }
+    }
+    
+    if (args.contains("save-models"))
+    {
+        auto directory = args.get<std::string>("save-models");
+        std::filesystem::create_directories(directory);
+        directory = blt::string::ensure_ends_with_path_separator(directory);
+        for (auto& job : jobs)
+            save_model(*job.network, directory + "network" + std::to_string(job.id) + ".model");
+        BLT_INFO("Saved %ld networks to '%s'", jobs.size(), directory.c_str());
+    }
+    
+    if (args.contains("serve"))
+    {
+        inference_server_t server{args.get<std::string>("serve"), std::stoul(args.get<std::string>("max-batch")),
+                                  std::chrono::microseconds(std::stoul(args.get<std::string>("deadline")))};
+        for (auto& [size, network] : networks)
+            server.add_network(static_cast<blt::size_t>(size), network);
+        
+        stop_on_interrupt();
+        BLT_INFO("Serving %ld networks on '%s'", networks.size(), args.get<std::string>("serve").c_str());
+        server.run([]() { return static_cast<bool>(stop_requested); });
+        
+        auto [batches, requests] = server.totals();
+        BLT_INFO("Answered %ld requests in %ld batches (%f per batch)", requests, batches,
+                 batches == 0 ? 0.0 : static_cast<double>(requests) / static_cast<double>(batches));
+        return 0;
+    }
+    
+    if (args.contains("monitor"))
+    {
+        auto size = std::stoi(args.get<std::string>("monitor-size"));
+        BLT_ASSERT_MSG(networks.find(size) != networks.end(), "There is no network of the size asked to monitor with");
+        stream_monitor_t monitor{networks[size], static_cast<blt::size_t>(size), std::stoul(args.get<std::string>("spectrum-bins")),
+                                 std::stoul(args.get<std::string>("hop")), std::stod(args.get<std::string>("budget"))};
+        auto fd = open_sample_source(args.get<std::string>("monitor"));
+        
+        stop_on_interrupt();
+        BLT_INFO("Monitoring with network %d", size);
+        monitor.run(fd, []() { return static_cast<bool>(stop_requested); });
+        if (fd != STDIN_FILENO)
+            close(fd);
+        
+        auto& latency = monitor.latency();
+        auto p99 = latency.percentile(0.99);
+        BLT_INFO("Monitored %ld windows, latency p50 %.1fus p99 %.1fus, %ld over the %.1fus budget", latency.windows(), latency.percentile(0.5),
+                 p99, latency.windows_over_budget(), latency.budget());
+        if (p99 > latency.budget())
+            BLT_WARN("p99 latency is over budget!");
+        return 0;
     }
     
     std::cout << "Hello World!" << std::endl;